@@ -1,17 +1,30 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
-// * To get a buffer for a particular disk block, call bread.
+// * To get a buffer for a particular disk block, call bread,
+//     or bnew if you will overwrite all of it.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
+// * To start reading a block that will be wanted soon, without
+//     waiting for it, call bprefetch.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed on (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups of different blocks from different
+// CPUs don't contend. A bucket lock protects the list of buffers in
+// that bucket and the refcnt and timestamp of each of them.
+//
+// When a block isn't cached, bget() recycles the unused buffer
+// that was released longest ago (by timestamp), taking it from
+// whatever bucket it is in. bcache.lock serializes such evictions,
+// so at most one process ever holds two bucket locks at a time.
 
 
 #include "types.h"
@@ -23,69 +36,174 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET 13
+
+// bprefetch() leaves at least this many buffers unused, so that
+// read-ahead can't take the buffers that bread() needs.
+#define NRESERVE (NREADAHEAD + MAXOPBLOCKS)
+
 struct {
-  struct spinlock lock;
+  struct spinlock lock;  // serializes evictions
   struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Per-bucket circular lists of buffers, through prev/next.
+  struct spinlock bucketlock[NBUCKET];
+  struct buf bucket[NBUCKET];
+
+  // statistics, updated atomically.
+  int nread;       // bread() calls
+  int nhit;        // ... that found the block cached
+  int nprefetch;   // blocks bprefetch() started reading
+  int nprefetchhit; // ... that a bread() then used
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Unlink b from its bucket's list.
+// Caller must hold that bucket's lock.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Insert b at the front of bucket h's list.
+// Caller must hold bcache.bucketlock[h].
+static void
+blink(struct buf *b, uint h)
+{
+  b->next = bcache.bucket[h].next;
+  b->prev = &bcache.bucket[h];
+  bcache.bucket[h].next->prev = b;
+  bcache.bucket[h].next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucketlock[i], "bcache.bucket");
+    bcache.bucket[i].prev = &bcache.bucket[i];
+    bcache.bucket[i].next = &bcache.bucket[i];
+  }
+
+  // Spread the buffers over the buckets to start with;
+  // eviction moves them to wherever they're needed.
+  for(b = bcache.buf, i = 0; b < bcache.buf+NBUF; b++, i++){
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->blockno = i;
+    blink(b, bhash(b->dev, b->blockno));
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block blockno on device dev in bucket h.
+// If found, take a reference to it and return it.
+// Caller must hold bcache.bucketlock[h].
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(uint dev, uint blockno, uint h)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bcache.bucket[h].next; b != &bcache.bucket[h]; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer, provided that at least
+// reserve other buffers remain unused.
+// In either case, return locked buffer.
+// Returns 0 if there is no buffer to allocate.
+static struct buf*
+bget(uint dev, uint blockno, int reserve)
+{
+  struct buf *b, *victim;
+  uint h = bhash(dev, blockno);
+  int i, vh, nfree;
+
+  acquire(&bcache.bucketlock[h]);
+  b = bfind(dev, blockno, h);
+  release(&bcache.bucketlock[h]);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached. Only one process evicts at a time; re-check in
+  // case another process brought the block in meanwhile.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucketlock[h]);
+  b = bfind(dev, blockno, h);
+  release(&bcache.bucketlock[h]);
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Recycle the least recently used unused buffer.
+  // Keep the lock of the bucket holding the best candidate
+  // so far, so the candidate can't be taken from under us.
+  victim = 0;
+  vh = -1;
+  nfree = 0;
+  for(i = 0; i < NBUCKET; i++){
+    int found = 0;
+    acquire(&bcache.bucketlock[i]);
+    for(b = bcache.bucket[i].next; b != &bcache.bucket[i]; b = b->next){
+      if(b->refcnt != 0)
+        continue;
+      nfree++;
+      if(victim == 0 || b->timestamp < victim->timestamp){
+        victim = b;
+        found = 1;
+      }
     }
+    if(found){
+      if(vh >= 0)
+        release(&bcache.bucketlock[vh]);
+      vh = i;
+    } else {
+      release(&bcache.bucketlock[i]);
+    }
+  }
+  if(victim == 0 || nfree <= reserve){
+    if(victim)
+      release(&bcache.bucketlock[vh]);
+    release(&bcache.lock);
+    return 0;
   }
-  panic("bget: no buffers");
+
+  b = victim;
+  b->refcnt = 1;
+  bunlink(b);
+  release(&bcache.bucketlock[vh]);
+
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->prefetched = 0;
+  acquire(&bcache.bucketlock[h]);
+  blink(b, h);
+  release(&bcache.bucketlock[h]);
+
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,14 +212,92 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  if((b = bget(dev, blockno, 0)) == 0)
+    panic("bget: no buffers");
+  __sync_fetch_and_add(&bcache.nread, 1);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
+  } else {
+    __sync_fetch_and_add(&bcache.nhit, 1);
+  }
+  if(b->prefetched){
+    b->prefetched = 0;
+    __sync_fetch_and_add(&bcache.nprefetchhit, 1);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it from the disk, for a caller that will overwrite all of it.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 0)) == 0)
+    panic("bget: no buffers");
+  b->valid = 1;
+  b->prefetched = 0;
+  return b;
+}
+
+// Drop a reference to b, whose lock has been released.
+static void
+bput(struct buf *b)
+{
+  uint h;
+
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucketlock[h]);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    b->timestamp = ticks;
+  }
+  release(&bcache.bucketlock[h]);
+}
+
+// Completion callback for bprefetch(), in interrupt context.
+static void
+bprefetched(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start reading the indicated block into the cache, if it isn't
+// there already, and return without waiting for the disk.
+// Does nothing if that would leave fewer than NRESERVE
+// buffers free.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+  uint h = bhash(dev, blockno);
+
+  acquire(&bcache.bucketlock[h]);
+  b = bfind(dev, blockno, h);
+  if(b)
+    b->refcnt--;
+  release(&bcache.bucketlock[h]);
+  if(b)
+    return;
+
+  if((b = bget(dev, blockno, NRESERVE)) == 0)
+    return;
+  if(b->valid){
+    // someone else read it meanwhile.
+    brelse(b);
+    return;
+  }
+  b->prefetched = 1;
+  __sync_fetch_and_add(&bcache.nprefetch, 1);
+  // bprefetched() releases b when the read finishes.
+  virtio_disk_start(b, 0, bprefetched);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,7 +308,7 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it became unused, for LRU eviction in bget().
 void
 brelse(struct buf *b)
 {
@@ -120,34 +316,33 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucketlock[h]);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucketlock[h]);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucketlock[h]);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucketlock[h]);
 }
 
 
+
+// Report buffer cache hit rates into buf.
+int
+statsbio(char *buf, int sz)
+{
+  return snprintf(buf, sz, "bread: %d reads, %d hits; read-ahead: %d blocks, %d used\n",
+                  bcache.nread, bcache.nhit, bcache.nprefetch, bcache.nprefetchhit);
+}
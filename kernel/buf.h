@@ -1,11 +1,13 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int prefetched; // read by bprefetch(), not yet by bread()?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint timestamp; // ticks when refcnt last fell to zero
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
@@ -0,0 +1,186 @@
+// Directory entry cache.
+//
+// Remembers the results of dirlookup(): for a directory and a
+// name, the inode number and offset of the matching entry, or
+// that there is none (a negative entry). Repeated lookups of the
+// same path then skip reading and scanning the directory.
+//
+// Entries are keyed on (dev, directory inum, name), and recycled
+// least recently used first. dirlink() and sys_unlink() drop the
+// entry for the name they change, and iput() drops all of a
+// directory's entries when it frees the directory, since its
+// inum may be reused.
+//
+// dcache.lock protects the table. Callers hold the directory's
+// sleep-lock, which keeps its contents from changing between a
+// lookup in the directory and the matching dcacheenter().
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDCACHE  128
+#define NDBUCKET 31
+
+struct dentry {
+  uint dev;
+  uint dinum;            // directory, or 0 if this entry is free
+  char name[DIRSIZ];
+  uint inum;             // 0 if the name isn't in the directory
+  uint off;              // offset of the entry in the directory
+  uint lastuse;          // ticks, for LRU eviction
+  struct dentry *next;   // hash bucket chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct dentry entry[NDCACHE];
+  struct dentry *bucket[NDBUCKET];
+  int nhit;
+  int nmiss;
+} dcache;
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + name[i];
+  return h % NDBUCKET;
+}
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// Look for the entry for name in dp.
+// Caller must hold dcache.lock.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *de;
+
+  for(de = dcache.bucket[dhash(dp->dev, dp->inum, name)]; de; de = de->next)
+    if(de->dev == dp->dev && de->dinum == dp->inum && namecmp(de->name, name) == 0)
+      return de;
+  return 0;
+}
+
+// Remove de from its bucket chain and free it.
+// Caller must hold dcache.lock.
+static void
+dremove(struct dentry *de)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.bucket[dhash(de->dev, de->dinum, de->name)]; *pp; pp = &(*pp)->next){
+    if(*pp == de){
+      *pp = de->next;
+      break;
+    }
+  }
+  de->next = 0;
+  de->dinum = 0;
+}
+
+// Look up name in directory dp.
+// Returns 1 and sets *inum (0 if name isn't in dp) and, if
+// found, *poff, if the answer is cached; 0 if it isn't.
+// Caller must hold dp->lock.
+int
+dcachelookup(struct inode *dp, char *name, uint *inum, uint *poff)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  if((de = dfind(dp, name)) == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return 0;
+  }
+  de->lastuse = ticks;
+  *inum = de->inum;
+  *poff = de->off;
+  dcache.nhit++;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in dp is inode inum, at offset off,
+// or, if inum is 0, that it isn't in dp.
+// Caller must hold dp->lock.
+void
+dcacheenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *de, *victim;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((de = dfind(dp, name)) == 0){
+    // Recycle a free entry, or else the least recently used one.
+    victim = 0;
+    for(de = dcache.entry; de < &dcache.entry[NDCACHE]; de++){
+      if(de->dinum == 0){
+        victim = de;
+        break;
+      }
+      if(victim == 0 || de->lastuse < victim->lastuse)
+        victim = de;
+    }
+    de = victim;
+    if(de->dinum)
+      dremove(de);
+    de->dev = dp->dev;
+    de->dinum = dp->inum;
+    strncpy(de->name, name, DIRSIZ);
+    h = dhash(de->dev, de->dinum, de->name);
+    de->next = dcache.bucket[h];
+    dcache.bucket[h] = de;
+  }
+  de->inum = inum;
+  de->off = off;
+  de->lastuse = ticks;
+  release(&dcache.lock);
+}
+
+// Forget what is known about name in dp, which is changing.
+// Caller must hold dp->lock.
+void
+dcacheinval(struct inode *dp, char *name)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  if((de = dfind(dp, name)) != 0)
+    dremove(de);
+  release(&dcache.lock);
+}
+
+// Forget all entries of directory dp, which is being freed.
+void
+dcachepurge(struct inode *dp)
+{
+  struct dentry *de;
+
+  acquire(&dcache.lock);
+  for(de = dcache.entry; de < &dcache.entry[NDCACHE]; de++)
+    if(de->dinum == dp->inum && de->dev == dp->dev)
+      dremove(de);
+  release(&dcache.lock);
+}
+
+// Report hit rates into buf.
+int
+statsdcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "dcache: %d hits, %d misses\n",
+                  dcache.nhit, dcache.nmiss);
+}
@@ -12,8 +12,11 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bprefetch(uint, uint);
+int             statsbio(char*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -22,8 +25,20 @@ void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcachelookup(struct inode*, char*, uint*, uint*);
+void            dcacheenter(struct inode*, char*, uint, uint);
+void            dcacheinval(struct inode*, char*);
+void            dcachepurge(struct inode*);
+int             statsdcache(char*, int);
+
 // exec.c
 int             exec(char*, char**);
+int             execfault(struct proc*, uint64);
+struct inode*   exedup(struct inode*);
+void            exeput(struct inode*);
+void            execprefault(struct proc*, uint64, uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -42,9 +57,12 @@ struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            iunlockshared(struct inode*);
+void            iunlockputshared(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
@@ -62,19 +80,31 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefcnt(void *);
 void            kinit(void);
+void*           superalloc(void);
+void            superfree(void *);
+void            supersplit(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+int             statslog(char*, int);
 void            begin_op(void);
 void            end_op(void);
 
+// pagecache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint);
+void            pcacheinval(struct inode*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipesplice(struct pipe*, uint64, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -97,11 +127,15 @@ struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
+void            setrunnable(struct proc*);
+void            schedtick(void);
+int             nice(int);
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeone(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -114,16 +148,27 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             statslock(char*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
+void            downgradesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -141,12 +186,18 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// start.c
+void            settimer(uint64);
+int             timertick(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+int             sleepticks(uint);
+int             sleepuntil(uint64);
 
 // uart.c
 void            uartinit(void);
@@ -165,6 +216,10 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+uint64          uvmlend(pagetable_t, uint64);
+int             uvmremap(pagetable_t, uint64, uint64);
+int             uvmfault(struct proc*, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -183,6 +238,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int, void (*)(struct buf *));
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_startv(uint, struct buf **, int, int);
+void            virtio_disk_rwv(uint, struct buf **, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -6,6 +6,9 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -23,11 +26,12 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -49,7 +53,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Set up the program's segments to be loaded on demand,
+  // by execfault(). Load any beyond NSEG into memory now.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,6 +66,19 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > TRAPFRAME || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(nseg < NSEG){
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].memsz = ph.memsz;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].off = ph.off;
+      seg[nseg].perm = flags2perm(ph.flags);
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -68,8 +86,12 @@ exec(char *path, char **argv)
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // keep a reference to ip, for execfault(). Counting it as
+  // running under ip->lock keeps writei() from racing with us.
+  __sync_fetch_and_add(&ip->nexec, 1);
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -122,11 +144,20 @@ exec(char *path, char **argv)
     
   // Commit to the user image.
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    exeput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,9 +168,132 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    exeput(exe);
+    end_op();
+  }
   return -1;
 }
 
+// Take another reference to ip, an executable that a process
+// is running (see fork()).
+struct inode*
+exedup(struct inode *ip)
+{
+  __sync_fetch_and_add(&ip->nexec, 1);
+  return idup(ip);
+}
+
+// Drop a reference to an executable that a process was
+// running. Must be called inside a transaction, like iput().
+void
+exeput(struct inode *ip)
+{
+  __sync_fetch_and_sub(&ip->nexec, 1);
+  iput(ip);
+}
+
+// If va lies in one of p's segments that exec() left to be
+// loaded on demand, map the page containing it: the page cache's
+// shared copy if it is a whole page of the file (copy-on-write,
+// if the segment is writable), otherwise a private copy.
+// Returns 0 if the page was mapped, -1 if it couldn't be, and
+// 1 if va isn't in such a segment.
+// May sleep, so it fails if the caller holds a spinlock.
+int
+execfault(struct proc *p, uint64 va)
+{
+  struct seg *s;
+  uint64 a, off, n, pa;
+  char *mem;
+  int perm, noff;
+
+  if(va >= p->sz)
+    return 1;
+  a = PGROUNDDOWN(va);
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(a >= s->va && a < s->va + s->memsz)
+      break;
+  if(s == &p->seg[p->nseg])
+    return 1;
+
+  // copyout() under a spinlock (e.g. either_copyout() with
+  // cons.lock held) can't sleep to read the page in.
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  if(noff > 1)
+    return -1;
+
+  // a read of the executable into its own unloaded pages
+  // (see execprefault()) would deadlock. fileread() locks
+  // p->exe exclusively so that this check sees it.
+  if(holdingsleep(&p->exe->lock))
+    return -1;
+
+  off = a - s->va;
+  perm = PTE_R | PTE_U | s->perm;
+  ilock(p->exe);
+  if(off + PGSIZE <= s->filesz && (s->off + off) % PGSIZE == 0){
+    if((pa = pcacheget(p->exe, s->off + off)) == 0)
+      goto bad;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else {
+    if((mem = kalloc()) == 0)
+      goto bad;
+    memset(mem, 0, PGSIZE);
+    if(off < s->filesz){
+      n = s->filesz - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(readi(p->exe, 0, (uint64)mem, s->off + off, n) != n){
+        kfree(mem);
+        goto bad;
+      }
+    }
+    pa = (uint64)mem;
+  }
+  iunlock(p->exe);
+
+  if(mappages(p->pagetable, a, PGSIZE, pa, perm) != 0){
+    kfree((void*)pa);
+    return -1;
+  }
+  return 0;
+
+ bad:
+  iunlock(p->exe);
+  return -1;
+}
+
+// Load any not-yet-loaded pages of p's executable in the
+// user range [va, va+len), so that copyin()/copyout() of them
+// won't need to. System calls do this before copying while
+// holding a spinlock or inode lock, which execfault()
+// couldn't sleep under or might deadlock on; a copy that
+// wasn't prefaulted fails instead.
+void
+execprefault(struct proc *p, uint64 va, uint64 len)
+{
+  struct seg *s;
+  uint64 a, start, end;
+  pte_t *pte;
+
+  if(va + len < va)
+    return;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    start = va > s->va ? va : s->va;
+    end = va + len < s->va + s->memsz ? va + len : s->va + s->memsz;
+    for(a = PGROUNDDOWN(start); a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0)
+        execfault(p, a);
+    }
+  }
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
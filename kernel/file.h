@@ -13,6 +13,15 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+// a run of contiguous disk blocks that bmap() found through
+// indirect blocks; len == 0 means the slot is unused.
+struct extent {
+  uint bn;            // first file block of the run
+  uint addr;          // disk block holding it
+  uint len;           // number of blocks
+};
+#define NEXTENT 4
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
@@ -26,7 +35,23 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+3];
+
+  struct spinlock extlock; // protects ext[] and extnext, since
+                      // readers share ip->lock
+  struct extent ext[NEXTENT]; // recently used runs of blocks
+  int extnext;        // next ext[] slot to replace
+  uint bhint;         // where to look for this file's next block
+
+  // read-ahead hints, updated without care for races by
+  // readers that share ip->lock.
+  uint raoff;         // where the last readi() ended
+  uint rablock;       // first block not yet read ahead
+
+  int nexec;          // processes running this file, which
+                      // therefore can't be written (see exec())
+
+  struct inode *next; // itable hash chain, or free list
 };
 
 // map major device number to device functions.
@@ -38,3 +63,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -26,6 +26,9 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+static void isuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +47,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -59,27 +64,100 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// bsum summarizes the free map: the number of free blocks
+// each bitmap block describes, so that balloc() can skip
+// full bitmap blocks without reading them, and where the
+// last allocation ended, so that it can search on from there
+// rather than from block 0. Callers also pass a hint, the
+// block after the last one they allocated, so that a file's
+// blocks tend to be contiguous on disk.
+
+struct {
+  struct spinlock lock;
+  uint *nfree;    // free blocks per bitmap block
+  int n;          // number of bitmap blocks
+  uint next;      // block after the last one allocated
+} bsum;
+
+// Count the free blocks in each bitmap block. Called after
+// log recovery, so the bitmap is up to date.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  int i, bi;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.n = (sb.size + BPB - 1) / BPB;
+  if(bsum.n * sizeof(uint) > PGSIZE || (bsum.nfree = kalloc()) == 0)
+    panic("bsuminit");
+  for(i = 0; i < bsum.n; i++){
+    bsum.nfree[i] = 0;
+    bp = bread(dev, sb.bmapstart + i);
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[i]++;
+    }
+    brelse(bp);
+  }
+}
+
+// Find a clear bit in bitmap block bp between bits from
+// and to-1, and set it. Returns the bit, or -1 if none.
+static int
+bclaim(struct buf *bp, int from, int to)
+{
+  int bi, m;
 
-// Allocate a zeroed disk block.
+  for(bi = from; bi < to; bi++){
+    if(bi % 8 == 0 && bi + 8 <= to && bp->data[bi/8] == 0xff){
+      bi += 7;  // skip a full byte
+      continue;
+    }
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){  // Is block free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      return bi;
+    }
+  }
+  return -1;
+}
+
+// Allocate a zeroed disk block, preferably hint or the first
+// free block after it; hint 0 means no preference.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint hint)
 {
-  int b, bi, m;
+  int i, k, bi, from, to;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(hint == 0 || hint >= sb.size)
+    hint = bsum.next;
+  if(hint >= sb.size)
+    hint = 0;
+
+  // visit every bitmap block starting with hint's, and
+  // finally the part of hint's block before hint.
+  for(k = 0; k <= bsum.n; k++){
+    i = (hint / BPB + k) % bsum.n;
+    if(bsum.nfree[i] == 0)
+      continue;
+    from = k == 0 ? hint % BPB : 0;
+    to = k == bsum.n ? hint % BPB : BPB;
+    if(i*BPB + to > sb.size)
+      to = sb.size - i*BPB;
+    bp = bread(dev, sb.bmapstart + i);
+    if((bi = bclaim(bp, from, to)) >= 0){
+      log_write(bp);
+      brelse(bp);
+      acquire(&bsum.lock);
+      bsum.nfree[i]--;
+      bsum.next = i*BPB + bi + 1;
+      release(&bsum.lock);
+      bzero(dev, i*BPB + bi);
+      return i*BPB + bi;
     }
     brelse(bp);
   }
@@ -102,6 +180,9 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  release(&bsum.lock);
 }
 
 // Inodes.
@@ -144,7 +225,11 @@ bfree(int dev, uint b)
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode.
+//   has first locked the inode. ilockshared() locks it
+//   only against modification, so that readi(),
+//   dirlookup() and stati() in different processes can
+//   run at once, and iunlockshared() unlocks it again;
+//   writei(), dirlink() and itrunc() need ilock().
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -164,33 +249,142 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table of in-use entries keyed on
+// (dev, inum), with a lock per bucket, so that lookups of
+// different inodes on different CPUs don't contend. Unused
+// entries are kept on a free list; when it runs out, the
+// table grows by a page's worth of entries.
+//
+// A bucket lock protects the chain of entries in its bucket,
+// and their ref, dev, and inum fields; since ip->ref indicates
+// whether an entry is in use, and ip->dev and ip->inum indicate
+// which i-node an entry holds, one must hold the bucket lock
+// while using any of those fields. itable.lock protects the
+// free list, and is taken while holding a bucket lock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 31
+
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lock;           // protects free
+  struct inode *free;             // unused entries
+  int n;                          // entries allocated
+  struct spinlock bucketlock[NIBUCKET];
+  struct inode *bucket[NIBUCKET]; // in-use entries
 } itable;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIBUCKET;
+}
+
+// Add a page's worth of entries to the free list.
+// Caller must hold itable.lock.
+// Returns -1 if out of memory.
+static int
+igrow(void)
+{
+  struct inode *ip;
+
+  if((ip = kalloc()) == 0)
+    return -1;
+  memset(ip, 0, PGSIZE);
+  for(int i = 0; i < PGSIZE / sizeof(struct inode); i++, ip++){
+    initsleeplock(&ip->lock, "inode");
+    initlock(&ip->extlock, "inode.ext");
+    ip->next = itable.free;
+    itable.free = ip;
+    itable.n++;
+  }
+  return 0;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  for(int i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucketlock[i], "itable.bucket");
+  acquire(&itable.lock);
+  while(itable.n < NINODE)
+    if(igrow() < 0)
+      panic("iinit");
+  release(&itable.lock);
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// isum keeps a bitmap of the on-disk inodes in use, built
+// from the inode blocks at boot, so that ialloc() can pick a
+// free inode without reading every inode block.
+struct {
+  struct spinlock lock;
+  uchar *used;    // bit i set if inode i is allocated
+  uint next;      // where to start looking
+} isum;
+
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum, i;
+
+  initlock(&isum.lock, "isum");
+  if(sb.ninodes > PGSIZE*8 || (isum.used = kalloc()) == 0)
+    panic("isuminit");
+  memset(isum.used, 0, PGSIZE);
+  isum.used[0] = 1;  // inode 0 is never allocated
+  for(inum = 0; inum < sb.ninodes; inum += IPB){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data;
+    for(i = 0; i < IPB && inum + i < sb.ninodes; i++){
+      if(dip[i].type != 0)
+        isum.used[(inum+i)/8] |= 1 << ((inum+i) % 8);
+    }
+    brelse(bp);
+  }
+  isum.next = 1;
+}
+
+// Claim an inode number that isum says is free.
+// Returns 0 if there is none.
+static uint
+iclaim(void)
+{
+  uint i, inum;
+
+  acquire(&isum.lock);
+  for(i = 0; i < sb.ninodes; i++){
+    inum = (isum.next + i) % sb.ninodes;
+    if(inum % 8 == 0 && inum + 8 <= sb.ninodes && isum.used[inum/8] == 0xff){
+      i += 7;  // skip a full byte
+      continue;
+    }
+    if((isum.used[inum/8] & (1 << (inum % 8))) == 0){
+      isum.used[inum/8] |= 1 << (inum % 8);
+      isum.next = inum + 1;
+      release(&isum.lock);
+      return inum;
+    }
+  }
+  release(&isum.lock);
+  return 0;
+}
+
+// Tell isum that inode inum is free on disk.
+static void
+iunclaim(uint inum)
+{
+  acquire(&isum.lock);
+  isum.used[inum/8] &= ~(1 << (inum % 8));
+  release(&isum.lock);
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
@@ -198,11 +392,11 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  while((inum = iclaim()) != 0){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
@@ -212,7 +406,7 @@ ialloc(uint dev, short type)
       brelse(bp);
       return iget(dev, inum);
     }
-    brelse(bp);
+    brelse(bp);  // isum was wrong; it now has this one as used
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -246,32 +440,35 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  uint h = ihash(dev, inum);
 
-  acquire(&itable.lock);
+  acquire(&itable.bucketlock[h]);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.bucket[h]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
-      release(&itable.lock);
+      release(&itable.bucketlock[h]);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Take an unused entry, growing the table if need be.
+  acquire(&itable.lock);
+  if(itable.free == 0 && igrow() < 0)
     panic("iget: no inodes");
+  ip = itable.free;
+  itable.free = ip->next;
+  release(&itable.lock);
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->next = itable.bucket[h];
+  itable.bucket[h] = ip;
+  release(&itable.bucketlock[h]);
 
   return ip;
 }
@@ -281,9 +478,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  uint h = ihash(ip->dev, ip->inum);
+
+  acquire(&itable.bucketlock[h]);
   ip->ref++;
-  release(&itable.lock);
+  release(&itable.bucketlock[h]);
   return ip;
 }
 
@@ -310,12 +509,35 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    memset(ip->ext, 0, sizeof(ip->ext));
+    ip->bhint = 0;
+    ip->raoff = 0;
+    ip->rablock = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
+// Lock the given inode shared, for looking at it without
+// changing it (readi(), dirlookup(), stati()).
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepshared(&ip->lock);
+
+  if(ip->valid == 0){
+    // read it in under the exclusive lock.
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    downgradesleep(&ip->lock);
+  }
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -326,6 +548,16 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Unlock the given inode, locked by ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->lock.readers < 1 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -336,7 +568,10 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct inode **pp;
+  uint h = ihash(ip->dev, ip->inum);
+
+  acquire(&itable.bucketlock[h]);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +580,33 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&itable.bucketlock[h]);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    iunclaim(ip->inum);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&itable.bucketlock[h]);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  if(ip->ref == 0){
+    // recycle the entry.
+    for(pp = &itable.bucket[h]; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    acquire(&itable.lock);
+    ip->next = itable.free;
+    itable.free = ip;
+    release(&itable.lock);
+  }
+  release(&itable.bucketlock[h]);
 }
 
 // Common idiom: unlock, then put.
@@ -369,12 +617,76 @@ iunlockput(struct inode *ip)
   iput(ip);
 }
 
+void
+iunlockputshared(struct inode *ip)
+{
+  iunlockshared(ip);
+  iput(ip);
+}
+
 // Inode content
 //
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], the next NDINDIRECT
+// in the blocks listed in block ip->addrs[NDIRECT+1], and
+// the last NTINDIRECT one level further below
+// ip->addrs[NDIRECT+2].
+//
+// Each in-core inode remembers a few runs of contiguous
+// blocks that it has found through indirect blocks, so that
+// mapping the rest of a run costs no indirect block reads.
+
+// Look bn up in ip's extent cache. Returns 0 on a miss.
+static uint
+extlookup(struct inode *ip, uint bn)
+{
+  struct extent *e;
+  uint addr = 0;
+
+  acquire(&ip->extlock);
+  for(e = ip->ext; e < ip->ext + NEXTENT; e++){
+    if(bn - e->bn < e->len){
+      addr = e->addr + (bn - e->bn);
+      break;
+    }
+  }
+  release(&ip->extlock);
+  return addr;
+}
+
+// a[i] in an indirect block holds file block bn. Remember
+// the run of contiguous disk blocks around it, replacing any
+// cached run that it overlaps.
+static void
+extenter(struct inode *ip, uint bn, uint *a, int i)
+{
+  struct extent *e;
+  int lo, hi;
+
+  for(lo = i; lo > 0 && a[lo-1] && a[lo-1] + 1 == a[lo]; lo--)
+    ;
+  for(hi = i; hi < NINDIRECT-1 && a[hi+1] == a[hi] + 1; hi++)
+    ;
+  if(lo == hi)
+    return;
+  bn -= i - lo;
+
+  acquire(&ip->extlock);
+  for(e = ip->ext; e < ip->ext + NEXTENT; e++){
+    if(e->len && e->bn < bn + (hi-lo+1) && bn < e->bn + e->len)
+      break;
+  }
+  if(e == ip->ext + NEXTENT){
+    e = &ip->ext[ip->extnext];
+    ip->extnext = (ip->extnext + 1) % NEXTENT;
+  }
+  e->bn = bn;
+  e->addr = a[lo];
+  e->len = hi - lo + 1;
+  release(&ip->extlock);
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -382,42 +694,86 @@ iunlockput(struct inode *ip)
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, *a, fbn, span;
+  int level, i;
   struct buf *bp;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ip->bhint);
       if(addr == 0)
         return 0;
+      ip->bhint = addr + 1;
       ip->addrs[bn] = addr;
     }
     return addr;
   }
+  if((addr = extlookup(ip, bn)) != 0)
+    return addr;
+  fbn = bn;
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  // which tree: 1 for single, 2 double, 3 triple indirect.
+  span = NINDIRECT;
+  for(level = 1; bn >= span; level++){
+    if(level == 3)
+      panic("bmap: out of range");
+    bn -= span;
+    span *= NINDIRECT;
+  }
+
+  // Load indirect blocks, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    addr = balloc(ip->dev, ip->bhint);
+    if(addr == 0)
+      return 0;
+    ip->bhint = addr + 1;
+    ip->addrs[NDIRECT+level-1] = addr;
+  }
+  for(; level > 0; level--){
+    span /= NINDIRECT;
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+    i = bn / span;
+    bn %= span;
+    if((addr = a[i]) == 0){
+      addr = balloc(ip->dev, ip->bhint);
       if(addr){
-        a[bn] = addr;
+        ip->bhint = addr + 1;
+        a[i] = addr;
         log_write(bp);
       }
     }
+    if(level == 1 && addr)
+      extenter(ip, fbn, a, i);
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
   }
+  return addr;
+}
+
+// Free indirect block addr and everything below it,
+// depth further levels of indirect blocks.
+static void
+itruncind(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
 
-  panic("bmap: out of range");
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      itruncind(dev, a[j], depth-1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -425,9 +781,7 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,20 +790,17 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      itruncind(ip->dev, ip->addrs[NDIRECT+i], i);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  memset(ip->ext, 0, sizeof(ip->ext));
 
   ip->size = 0;
   iupdate(ip);
+  pcacheinval(ip);
 }
 
 // Copy stat information from inode.
@@ -471,7 +822,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn, end;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -479,6 +830,25 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // If this read continues the last one, start reading the
+  // rest of it and the next NREADAHEAD blocks from the disk.
+  if(off == ip->raoff && n > 0 && ip->type == T_FILE){
+    bn = off/BSIZE + 1;
+    if(bn < ip->rablock)
+      bn = ip->rablock;
+    end = min((off + n - 1)/BSIZE + 1 + NREADAHEAD, (ip->size + BSIZE - 1)/BSIZE);
+    for(; bn < end; bn++){
+      uint addr = bmap(ip, bn);
+      if(addr == 0)
+        break;
+      bprefetch(ip->dev, addr);
+    }
+    ip->rablock = bn;
+  } else {
+    ip->rablock = 0;
+  }
+  ip->raoff = off + n;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -512,6 +882,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // a running program loads its pages from the file on demand.
+  if(ip->nexec > 0)
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -529,6 +902,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size)
     ip->size = off;
+  if(tot > 0)
+    pcacheinval(ip);
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
@@ -546,17 +921,247 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hash a directory entry name, for indexed directories
+// (see fs.h). mkfs has a copy.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;  // FNV-1a
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Address of entry i of the table in index block bp.
+static ushort*
+dirtabent(struct buf *bp, uint i)
+{
+  return &((struct dirtab*)bp->data + 1 + i/DIRTAB)->bucket[i%DIRTAB];
+}
+
+// If dp is an indexed directory, return its locked index block;
+// otherwise 0.
+static struct buf*
+dirindexblock(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirhdr *h;
+  uint addr;
+
+  if(dp->size < BSIZE || (addr = bmap(dp, 0)) == 0)
+    return 0;
+  bp = bread(dp->dev, addr);
+  h = (struct dirhdr*)bp->data;
+  if(h->zero == 0 && h->magic == DIRMAGIC)
+    return bp;
+  brelse(bp);
+  return 0;
+}
+
+// The bucket of indexed directory dp that name belongs in;
+// ib is dp's index block.
+static uint
+dirbucket(struct buf *ib, char *name)
+{
+  struct dirhdr *h = (struct dirhdr*)ib->data;
+
+  return *dirtabent(ib, dirhash(name) & ((1 << h->depth) - 1));
+}
+
+// Turn dp, a directory with one full block of entries, into
+// an indexed directory with two buckets.
+// Returns 0 on success, -1 if out of disk blocks.
+static int
+dirindex(struct inode *dp)
+{
+  struct buf *ib, *bp[2];
+  struct dirent *de, *to;
+  struct dirhdr *h;
+  uint addr[2], n[2], i, k;
+
+  if((addr[0] = bmap(dp, 1)) == 0 || (addr[1] = bmap(dp, 2)) == 0)
+    return -1;
+  ib = bread(dp->dev, bmap(dp, 0));
+
+  // a bucket holds DPB-1 entries.
+  n[0] = n[1] = 0;
+  for(de = (struct dirent*)ib->data; de < (struct dirent*)(ib->data + BSIZE); de++)
+    if(de->inum)
+      n[dirhash(de->name) & 1]++;
+  if(n[0] >= DPB || n[1] >= DPB){
+    brelse(ib);
+    return -1;
+  }
+
+  for(k = 0; k < 2; k++){
+    bp[k] = bread(dp->dev, addr[k]);
+    memset(bp[k]->data, 0, BSIZE);
+    ((struct dirhdr*)bp[k]->data)->depth = 1;
+    n[k] = 1;
+  }
+  for(de = (struct dirent*)ib->data; de < (struct dirent*)(ib->data + BSIZE); de++){
+    if(de->inum == 0)
+      continue;
+    k = dirhash(de->name) & 1;
+    to = (struct dirent*)bp[k]->data + n[k];
+    *to = *de;
+    dcacheenter(dp, to->name, to->inum, (k+1)*BSIZE + n[k]*sizeof(*de));
+    n[k]++;
+  }
+
+  memset(ib->data, 0, BSIZE);
+  h = (struct dirhdr*)ib->data;
+  h->magic = DIRMAGIC;
+  h->depth = 1;
+  for(i = 0; i < 2; i++)
+    *dirtabent(ib, i) = i + 1;
+
+  for(k = 0; k < 2; k++){
+    log_write(bp[k]);
+    brelse(bp[k]);
+  }
+  log_write(ib);
+  brelse(ib);
+  dp->size = 3*BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Split full bucket b of indexed directory dp in two, by one
+// more bit of hash, doubling the table if b already used all
+// of the table's bits.
+// Returns 0 on success, -1 if the directory or disk is full.
+static int
+dirsplit(struct inode *dp, uint b)
+{
+  struct buf *ib, *bp, *np;
+  struct dirhdr *ih, *bh;
+  struct dirent *de, *to;
+  uint nb, addr, d, i, n;
+
+  ib = dirindexblock(dp);
+  ih = (struct dirhdr*)ib->data;
+  bp = bread(dp->dev, bmap(dp, b));
+  bh = (struct dirhdr*)bp->data;
+  d = bh->depth;
+  nb = dp->size / BSIZE;
+  if((d == ih->depth && ih->depth == DIRMAXDEPTH) || (addr = bmap(dp, nb)) == 0){
+    brelse(bp);
+    brelse(ib);
+    return -1;
+  }
+
+  if(d == ih->depth){
+    n = 1 << ih->depth;
+    for(i = 0; i < n; i++)
+      *dirtabent(ib, n + i) = *dirtabent(ib, i);
+    ih->depth++;
+  }
+  for(i = 0; i < (1 << ih->depth); i++)
+    if(*dirtabent(ib, i) == b && ((i >> d) & 1))
+      *dirtabent(ib, i) = nb;
+
+  // move the entries with bit d set to the new bucket.
+  np = bread(dp->dev, addr);
+  memset(np->data, 0, BSIZE);
+  bh->depth = d + 1;
+  ((struct dirhdr*)np->data)->depth = d + 1;
+  to = (struct dirent*)np->data + 1;
+  for(de = (struct dirent*)bp->data + 1; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(de->inum == 0 || ((dirhash(de->name) >> d) & 1) == 0)
+      continue;
+    *to = *de;
+    memset(de, 0, sizeof(*de));
+    dcacheenter(dp, to->name, to->inum, nb*BSIZE + ((char*)to - (char*)np->data));
+    to++;
+  }
+
+  log_write(np);
+  brelse(np);
+  log_write(bp);
+  brelse(bp);
+  log_write(ib);
+  brelse(ib);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return 0;
+}
+
+// Add the entry (name, inum) to indexed directory dp.
+// Returns its offset, or -1 if the directory or disk is full.
+static int
+dirinsert(struct inode *dp, char *name, uint inum)
+{
+  struct buf *ib, *bp;
+  struct dirent *de;
+  uint b;
+
+  // one split nearly always makes room.
+  for(int split = 0; ; split = 1){
+    ib = dirindexblock(dp);
+    b = dirbucket(ib, name);
+    brelse(ib);
+
+    bp = bread(dp->dev, bmap(dp, b));
+    for(de = (struct dirent*)bp->data + 1; de < (struct dirent*)(bp->data + BSIZE); de++){
+      if(de->inum == 0){
+        strncpy(de->name, name, DIRSIZ);
+        de->inum = inum;
+        log_write(bp);
+        brelse(bp);
+        return b*BSIZE + ((char*)de - (char*)bp->data);
+      }
+    }
+    brelse(bp);
+
+    if(split || dirsplit(dp, b) < 0)
+      return -1;
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Consults and fills in the directory entry cache.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, b;
+  struct dirent de, *dep;
+  struct buf *bp;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcachelookup(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if((bp = dirindexblock(dp)) != 0){
+    // search just the bucket name belongs in.
+    b = dirbucket(bp, name);
+    brelse(bp);
+    bp = bread(dp->dev, bmap(dp, b));
+    for(dep = (struct dirent*)bp->data + 1; dep < (struct dirent*)(bp->data + BSIZE); dep++){
+      if(dep->inum && namecmp(name, dep->name) == 0){
+        off = b*BSIZE + ((char*)dep - (char*)bp->data);
+        inum = dep->inum;
+        brelse(bp);
+        if(poff)
+          *poff = off;
+        dcacheenter(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
+    }
+    brelse(bp);
+    dcacheenter(dp, name, 0, 0);
+    return 0;
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1172,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcacheenter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheenter(dp, name, 0, 0);
   return 0;
 }
 
@@ -582,6 +1189,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -589,6 +1197,11 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if((bp = dirindexblock(dp)) != 0){
+    brelse(bp);
+    goto indexed;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -597,12 +1210,30 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  if(off >= BSIZE && dp->size == BSIZE){
+    // outgrowing the first block.
+    if(dirindex(dp) < 0)
+      return -1;
+    goto indexed;
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)){
+    dcacheinval(dp, name);
     return -1;
+  }
+  dcacheenter(dp, name, inum, off);
 
   return 0;
+
+ indexed:
+  if((off = dirinsert(dp, name, inum)) < 0){
+    dcacheinval(dp, name);
+    return -1;
+  }
+  dcacheenter(dp, name, inum, off);
+  return 0;
 }
 
 // Paths
@@ -659,21 +1290,21 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockputshared(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
     if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+      iunlockputshared(ip);
       return 0;
     }
-    iunlockput(ip);
+    iunlockputshared(ip);
     ip = next;
   }
   if(nameiparent){
@@ -24,9 +24,11 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +37,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+3];   // Data block addresses
 };
 
 // Inodes per block.
@@ -58,3 +60,33 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows its first block becomes an indexed
+// directory, an extendible hash table of its entries. Block 0
+// holds the index: a header, and a table mapping the low
+// (global depth) bits of a name's dirhash() to the block that
+// holds the name's entry. Every other block is a bucket: a
+// header, then DPB-1 entries, all of whose hashes agree in the
+// low (local depth) bits. Headers and table live in dirents
+// whose inum is 0, so reading an indexed directory's dirents
+// in order still finds exactly its entries.
+#define DIRMAGIC      0x4944   // in the index block's header
+#define DIRMAXDEPTH   8        // so at most 256 buckets
+#define DIRTAB        7        // table entries per dirent
+
+// First dirent of the index block and of each bucket.
+struct dirhdr {
+  ushort zero;        // inum: always 0
+  ushort magic;       // DIRMAGIC in the index block, 0 in buckets
+  ushort depth;       // hash bits used: global (index), local (bucket)
+  char pad[DIRSIZ-4];
+};
+
+// Dirents 1.. of the index block hold the table.
+struct dirtab {
+  ushort zero;        // inum: always 0
+  ushort bucket[DIRTAB]; // block numbers within the directory
+};
+
@@ -1,6 +1,14 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each page has a reference count, so that copy-on-write
+// fork can share a page between page tables; kfree() only
+// puts a page back on a free list when its count reaches zero.
+//
+// The top NSUPERPG*2MB of RAM is kept as 2-megabyte superpages
+// (superalloc()), which a page table can map with a single PTE.
+// kalloc() breaks up a superpage if it runs out of 4096-byte pages.
 
 #include "types.h"
 #include "param.h"
@@ -18,16 +26,45 @@ struct run {
   struct run *next;
 };
 
+// Each CPU has its own free list, protected by its own lock,
+// so that CPUs allocating and freeing in parallel don't
+// contend. A CPU whose list is empty steals from another's.
+struct kmem {
+  struct spinlock lock;
+  struct run *freelist;
+};
+
+struct kmem kmem[NCPU];
+
+// Reference counts, indexed by physical page number above KERNBASE.
+// Updated with atomic instructions rather than under a lock, so
+// kalloc() and kfree() stay free of cross-CPU contention.
+int kref[(PHYSTOP-KERNBASE)/PGSIZE];
+
+#define PA2REF(pa) (&kref[((uint64)(pa) - KERNBASE) / PGSIZE])
+
+// Free superpages. A superpage's reference count is that
+// of its first page.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+} ksuper;
+
+#define SUPERBASE (PHYSTOP - NSUPERPG*SUPERPGSIZE)
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  char *p;
+
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&ksuper.lock, "ksuper");
+  freerange(end, (void*)SUPERBASE);
+  for(p = (char*)SUPERBASE; p < (char*)PHYSTOP; p += SUPERPGSIZE){
+    *PA2REF(p) = 1;
+    superfree(p);
+  }
 }
 
 void
@@ -35,31 +72,63 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    *PA2REF(p) = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
+// Drop a reference to the page of physical memory pointed at by pa,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
   struct run *r;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(n > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  struct kmem *km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  release(&km->lock);
+  pop_off();
+}
+
+// Take a page from some other CPU's free list.
+// Holds only one kmem lock at a time, so two CPUs
+// stealing from each other can't deadlock.
+static struct run *
+ksteal(int id)
+{
+  struct run *r = 0;
+
+  for(int i = 1; i < NCPU && r == 0; i++){
+    struct kmem *km = &kmem[(id + i) % NCPU];
+    acquire(&km->lock);
+    r = km->freelist;
+    if(r)
+      km->freelist = r->next;
+    release(&km->lock);
+  }
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +139,103 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  push_off();
+  int id = cpuid();
+  struct kmem *km = &kmem[id];
+  acquire(&km->lock);
+  r = km->freelist;
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    km->freelist = r->next;
+  release(&km->lock);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
+  if(r == 0 && (r = superalloc()) != 0){
+    // out of pages; break up a superpage, keep its
+    // first page, and free the rest.
+    supersplit(r);
+    for(char *p = (char*)r + PGSIZE; p < (char*)r + SUPERPGSIZE; p += PGSIZE)
+      kfree(p);
+  }
 
-  if(r)
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    *PA2REF(r) = 1;
+  }
+  return (void*)r;
+}
+
+// Add a reference to the allocated page pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(PA2REF(pa), 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to the allocated page pa.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(PA2REF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Allocate one 2-megabyte superpage of physical memory.
+// Unlike kalloc(), doesn't fill it with junk: callers
+// zero or copy over all of it anyway.
+// Returns 0 if none is free.
+void *
+superalloc(void)
+{
+  struct run *r;
+
+  acquire(&ksuper.lock);
+  r = ksuper.freelist;
+  if(r)
+    ksuper.freelist = r->next;
+  release(&ksuper.lock);
+
+  if(r)
+    *PA2REF(r) = 1;
   return (void*)r;
 }
+
+// Drop a reference to the superpage pa, which was returned by
+// superalloc(); kdup(pa) adds one. The superpage is freed
+// when its last reference goes away.
+void
+superfree(void *pa)
+{
+  struct run *r;
+  int n;
+
+  if(((uint64)pa % SUPERPGSIZE) != 0 || (uint64)pa < SUPERBASE || (uint64)pa >= PHYSTOP)
+    panic("superfree");
+  n = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if(n > 0)
+    return;
+  if(n < 0)
+    panic("superfree: ref");
+
+  r = (struct run*)pa;
+  acquire(&ksuper.lock);
+  r->next = ksuper.freelist;
+  ksuper.freelist = r;
+  release(&ksuper.lock);
+}
+
+// Turn the allocated superpage pa into 512 allocated pages,
+// each with one reference, to be freed with kfree().
+// pa must not be shared.
+void
+supersplit(void *pa)
+{
+  if(((uint64)pa % SUPERPGSIZE) != 0 || (uint64)pa < SUPERBASE || (uint64)pa >= PHYSTOP)
+    panic("supersplit");
+  if(krefcnt(pa) != 1)
+    panic("supersplit: shared");
+  for(char *p = (char*)pa + PGSIZE; p < (char*)pa + SUPERPGSIZE; p += PGSIZE)
+    *PA2REF(p) = 1;
+}
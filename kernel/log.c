@@ -10,16 +10,30 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
+// calls. A transaction is closed, and its commit begins, only
+// when there are no FS system calls active in it. Thus there
+// is never any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the open transaction has been committed.
+//
+// Commits are group commits that overlap with new system
+// calls. When the last outstanding end_op() closes the open
+// transaction, its header moves to log.clh and its blocks are
+// copied from the buffer cache into the log's buffers; only
+// that copy, which involves no disk I/O for cached blocks,
+// holds up begin_op(). New system calls then proceed in a
+// fresh transaction (log.lh) while the closed one is written
+// to the log and installed. Installation writes the log's
+// copies, not the cached blocks, since those may already hold
+// the next transaction's uncommitted changes. A transaction
+// that closes while a commit is in progress is committed, once
+// that commit finishes, by the end_op() that closed it, so
+// that no one process commits on and on for everyone else.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -42,9 +56,16 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // in commit(); end_op() waits to commit after it.
+  int copying;     // commit() is copying out log.lh, please wait.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // the open transaction
+  struct logheader clh;  // the transaction being committed
+  struct buf *lbuf[LOGSIZE]; // log blocks of clh, held by commit()
+  struct buf *dbuf[LOGSIZE]; // pinned cache blocks of clh
+  int ncommit;     // statistics
+  int nop;
+  int nblock;
 };
 struct log log;
 
@@ -68,35 +89,68 @@ initlog(int dev, struct superblock *sb)
 static void
 install_trans(int recovering)
 {
-  int tail;
+  int tail, i, n, nrun;
+  int run[LOGSIZE];  // where each request's blocks start
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if(recovering){
+    for (tail = 0; tail < log.clh.n; tail++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      struct buf *dbuf = bread(log.dev, log.clh.block[tail]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    return;
+  }
+
+  // Write the log's copies, not the cached blocks, which may
+  // be newer; and write each run of consecutive home blocks
+  // with one disk request, all of them in flight at once.
+  // Sort by home block to find the runs.
+  for (tail = 1; tail < log.clh.n; tail++) {
+    int b = log.clh.block[tail];
+    struct buf *lb = log.lbuf[tail], *db = log.dbuf[tail];
+    for (i = tail; i > 0 && log.clh.block[i-1] > b; i--) {
+      log.clh.block[i] = log.clh.block[i-1];
+      log.lbuf[i] = log.lbuf[i-1];
+      log.dbuf[i] = log.dbuf[i-1];
+    }
+    log.clh.block[i] = b;
+    log.lbuf[i] = lb;
+    log.dbuf[i] = db;
+  }
+  nrun = 0;
+  for (tail = 0; tail < log.clh.n; tail += n) {
+    for (n = 0; tail + n < log.clh.n &&
+           log.clh.block[tail+n] == log.clh.block[tail] + n; n++)
+      ;
+    virtio_disk_startv(log.clh.block[tail], &log.lbuf[tail], n, 1);
+    run[nrun++] = tail;
+  }
+  for (i = 0; i < nrun; i++)
+    virtio_disk_wait(log.lbuf[run[i]]);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    bunpin(log.dbuf[tail]);
+    brelse(log.lbuf[tail]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the in-memory committed header
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write in-memory committed log header to disk.
 // This is the true point at which the
 // current transaction commits.
 static void
@@ -105,9 +159,9 @@ write_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,7 +172,7 @@ recover_from_log(void)
 {
   read_head();
   install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  log.clh.n = 0;
   write_head(); // clear the log
 }
 
@@ -128,7 +182,7 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.copying){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
@@ -142,7 +196,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// closes the transaction if this was the last outstanding
+// operation, and commits it, first waiting for any commit
+// already in progress to finish.
 void
 end_op(void)
 {
@@ -150,16 +206,21 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.nop++;
+  if(log.copying)
+    panic("log.copying");
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  // if a system call begins meanwhile, its end_op()
+  // will commit instead.
+  while(log.outstanding == 0 && log.committing && log.lh.n > 0)
+    sleep(&log, &log.lock);
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    log.copying = 1;
   }
   release(&log.lock);
 
@@ -167,39 +228,63 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to the log's buffers.
+// No FS system calls are running, so they are unchanging.
 static void
-write_log(void)
+copy_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *to = bnew(log.dev, log.start+tail+1); // log block
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    log.lbuf[tail] = to;
+    log.dbuf[tail] = from;  // still pinned by log_write()
     brelse(from);
-    brelse(to);
   }
 }
 
+// Write the copied blocks to the log, in one disk request.
+static void
+write_log(void)
+{
+  virtio_disk_rwv(log.start+1, log.lbuf, log.clh.n, 1);
+}
+
+// Commit the open transaction. Called with log.committing
+// and log.copying set, and no FS system calls outstanding.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  acquire(&log.lock);
+  log.clh = log.lh;
+  log.lh.n = 0;
+  release(&log.lock);
+
+  copy_log();      // Snapshot modified blocks into the log's buffers
+
+  acquire(&log.lock);
+  log.copying = 0;
+  wakeup(&log);    // let new FS system calls start
+  release(&log.lock);
+
+  if (log.clh.n > 0) {
+    write_log();     // Write the snapshot to the log
     write_head();    // Write header to disk -- the real commit
     install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
+    log.clh.n = 0;
     write_head();    // Erase the transaction from the log
+    __sync_fetch_and_add(&log.ncommit, 1);
   }
+
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);    // let a waiting end_op() commit
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -230,7 +315,20 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+    log.nblock++;
   }
   release(&log.lock);
 }
 
+// Report commit statistics into buf.
+int
+statslog(char *buf, int sz)
+{
+  int n;
+
+  acquire(&log.lock);
+  n = snprintf(buf, sz, "log: %d commits, %d ops, %d blocks\n",
+               log.ncommit, log.nop, log.nblock);
+  release(&log.lock);
+  return n;
+}
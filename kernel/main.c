@@ -12,6 +12,7 @@ main()
 {
   if(cpuid() == 0){
     consoleinit();
+    statsinit();
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
@@ -27,6 +28,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    dcacheinit();    // directory entry cache
+    pcacheinit();    // page cache for executables
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -29,6 +29,8 @@
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_FREQ 10000000          // CLINT_MTIME cycles per second.
+#define TICKCYCLES 1000000           // cycles per timer interrupt (tick).
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
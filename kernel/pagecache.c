@@ -0,0 +1,173 @@
+// Page cache.
+//
+// Holds whole pages of file contents that exec() maps into
+// user address spaces (see execfault() in exec.c), so that
+// processes running the same program share one physical copy
+// of its text, and repeated execs don't re-read it from disk.
+//
+// Each cached page is keyed on (dev, inum, offset) and the
+// cache holds one reference to it (see kdup() in kalloc.c);
+// each page table mapping it holds another. Evicting or
+// invalidating an entry only drops the cache's reference.
+//
+// Pages are hashed on (dev, inum) alone, so that
+// pcacheinval() can find all of a file's pages in one bucket
+// when the file is written or truncated.
+//
+// pcache.lock protects the table. Callers of pcacheget() and
+// pcacheinval() hold the inode's sleep-lock, which keeps
+// filling a page and invalidating the file from racing.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCACHE  256  // cached pages
+#define NPBUCKET 31
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;              // file offset, page-aligned
+  uint64 pa;             // cached page, or 0 if this slot is free
+  uint lastuse;          // ticks, for LRU eviction
+  struct pcpage *next;   // hash bucket chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+  struct pcpage *bucket[NPBUCKET];
+} pcache;
+
+static uint
+phash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NPBUCKET;
+}
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Remove pg from its bucket chain.
+// Caller must hold pcache.lock.
+static void
+punlink(struct pcpage *pg)
+{
+  struct pcpage **pp;
+
+  for(pp = &pcache.bucket[phash(pg->dev, pg->inum)]; *pp; pp = &(*pp)->next){
+    if(*pp == pg){
+      *pp = pg->next;
+      break;
+    }
+  }
+  pg->next = 0;
+}
+
+// Look for the page of ip at off.
+// Caller must hold pcache.lock.
+static struct pcpage*
+plookup(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+
+  for(pg = pcache.bucket[phash(ip->dev, ip->inum)]; pg; pg = pg->next)
+    if(pg->dev == ip->dev && pg->inum == ip->inum && pg->off == off)
+      return pg;
+  return 0;
+}
+
+// Return the physical address of a page holding the PGSIZE bytes
+// of ip starting at off, which must be page-aligned and within
+// the file. Reads the page from disk if it isn't cached.
+// The caller gets its own reference to the page, to be dropped
+// with kfree(), and must not write to it.
+// Caller must hold ip->lock.
+// Returns 0 if out of memory or the file is too short.
+uint64
+pcacheget(struct inode *ip, uint off)
+{
+  struct pcpage *pg, *victim;
+  char *mem;
+
+  if(!holdingsleep(&ip->lock))
+    panic("pcacheget");
+
+  acquire(&pcache.lock);
+  if((pg = plookup(ip, off)) != 0){
+    pg->lastuse = ticks;
+    kdup((void*)pg->pa);
+    release(&pcache.lock);
+    return pg->pa;
+  }
+  release(&pcache.lock);
+
+  // Not cached. Read it without holding pcache.lock;
+  // ip->lock keeps anyone else from filling the same page.
+  if((mem = kalloc()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)mem, off, PGSIZE) != PGSIZE){
+    kfree(mem);
+    return 0;
+  }
+
+  // Recycle a free slot, or else the least recently used one.
+  acquire(&pcache.lock);
+  victim = 0;
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    if(pg->pa == 0){
+      victim = pg;
+      break;
+    }
+    if(victim == 0 || pg->lastuse < victim->lastuse)
+      victim = pg;
+  }
+  pg = victim;
+  if(pg->pa){
+    punlink(pg);
+    kfree((void*)pg->pa);
+  }
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->off = off;
+  pg->pa = (uint64)mem;
+  pg->lastuse = ticks;
+  pg->next = pcache.bucket[phash(ip->dev, ip->inum)];
+  pcache.bucket[phash(ip->dev, ip->inum)] = pg;
+  kdup(mem);  // one reference for the cache, one for the caller
+  release(&pcache.lock);
+
+  return (uint64)mem;
+}
+
+// Forget any cached pages of ip, whose contents are changing.
+// Pages already mapped by processes are unaffected.
+// Caller must hold ip->lock.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcpage **pp, *pg;
+
+  acquire(&pcache.lock);
+  pp = &pcache.bucket[phash(ip->dev, ip->inum)];
+  while((pg = *pp) != 0){
+    if(pg->dev == ip->dev && pg->inum == ip->inum){
+      *pp = pg->next;
+      pg->next = 0;
+      kfree((void*)pg->pa);
+      pg->pa = 0;
+    } else {
+      pp = &pg->next;
+    }
+  }
+  release(&pcache.lock);
+}
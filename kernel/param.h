@@ -2,12 +2,16 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // active i-nodes to allocate at boot (the table grows)
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define NBUF         (MAXOPBLOCKS*12) // size of disk block cache
+#define NREADAHEAD    8  // blocks to read ahead of a sequential readi()
+#define FSSIZE       10000 // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSUPERPG     16    // 2MB superpages set aside for large mappings
+#define NPRIO         3    // scheduling priority levels
+#define BOOSTTICKS   50    // ticks between priority boosts
@@ -8,17 +8,48 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The ring is PIPEPAGES separately allocated pages. Data moves
+// between it and user memory in spans that are contiguous in
+// both the ring and a page, with one copyin()/copyout() each.
+//
+// Only one writer and one reader use a pipe at a time (see
+// pipewrite() and piperead()), so the ring has a single
+// producer, which alone advances nwrite, and a single
+// consumer, which alone advances nread. Neither needs
+// pi->lock to move data; they take it only to sleep when the
+// ring is full or empty, and to wake a peer that has said,
+// through wwait or rwait, that it is asleep.
+//
+// Whole pages can also move without copying: pipesplice()
+// lends the writer's pages to the ring copy-on-write, and
+// piperead() maps whole ring pages copy-on-write into the
+// reader in place of its own. A ring page may therefore be
+// shared; the writer replaces it before writing into it.
+#define PIPEPAGES 4
+#define PIPESIZE (PIPEPAGES*PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEPAGES];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a reader is in piperead()
+  int writing;    // a writer is in pipewrite()
+  int rwait;      // the reader is waiting for data
+  int wwait;      // the writer is waiting for space
 };
 
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < PIPEPAGES; i++)
+    if(pi->page[i])
+      kfree(pi->page[i]);
+  kfree((char*)pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -30,6 +61,10 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  memset(pi, 0, sizeof(*pi));
+  for(int i = 0; i < PIPEPAGES; i++)
+    if((pi->page[i] = kalloc()) == 0)
+      goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -47,7 +82,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,63 +103,229 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    freelock(&pi->lock);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
-int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+// Wait for *flag to be clear, then set it, so that this
+// process is the only reader (or writer) of pi.
+// Returns -1 if killed.
+static int
+pipeenter(struct pipe *pi, int *flag)
 {
-  int i = 0;
-  struct proc *pr = myproc();
-
   acquire(&pi->lock);
-  while(i < n){
-    if(pi->readopen == 0 || killed(pr)){
+  while(*flag){
+    if(killed(myproc())){
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
+    sleep(flag, &pi->lock);
+  }
+  *flag = 1;
+  release(&pi->lock);
+  return 0;
+}
+
+static void
+pipeleave(struct pipe *pi, int *flag)
+{
+  acquire(&pi->lock);
+  *flag = 0;
+  wakeup(flag);
+  release(&pi->lock);
+}
+
+// Having moved data, wake the peer if it is waiting on chan.
+// The fence pairs with the one in pipewait(): either the peer
+// sees the new nread/nwrite before it sleeps, or this sees
+// *waiting set and wakes it, under pi->lock so that the
+// wakeup cannot come between its check and its sleep.
+static void
+pipekick(struct pipe *pi, int *waiting, void *chan)
+{
+  __sync_synchronize();
+  if(*waiting){
+    acquire(&pi->lock);
+    wakeup(chan);
+    release(&pi->lock);
+  }
+}
+
+// The ring is full (writer) or empty (reader): sleep until
+// the peer moves data or closes its end.
+// Returns -1 if the reader has closed the pipe (writer), or
+// the process is killed; 0 otherwise.
+static int
+pipewait(struct pipe *pi, int writer)
+{
+  struct proc *pr = myproc();
+  int *waiting = writer ? &pi->wwait : &pi->rwait;
+  int r = 0;
+
+  acquire(&pi->lock);
+  *waiting = 1;
+  __sync_synchronize();
+  for(;;){
+    if(writer){
+      if(pi->readopen == 0)
+        r = -1;
+      else if(pi->nwrite != pi->nread + PIPESIZE)  //DOC: pipewrite-full
+        break;
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      if(pi->nread != pi->nwrite || pi->writeopen == 0)  //DOC: pipe-empty
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
     }
+    if(r < 0 || killed(pr)){
+      r = -1;
+      break;
+    }
+    sleep(writer ? (void*)&pi->nwrite : (void*)&pi->nread, &pi->lock);
   }
-  wakeup(&pi->nread);
+  *waiting = 0;
   release(&pi->lock);
+  return r;
+}
+
+// The span of the ring at byte count x that is contiguous
+// in a page: where it starts and how long it may be.
+static char*
+pipespan(struct pipe *pi, uint x, uint *len)
+{
+  uint off = x % PIPESIZE;
+
+  if(*len > PGSIZE - off % PGSIZE)
+    *len = PGSIZE - off % PGSIZE;
+  return pi->page[off / PGSIZE] + off % PGSIZE;
+}
+
+// Make the ring page holding byte count x private to the
+// pipe, so the writer can write into it. Keeps all of the
+// page, since the reader may not yet have read the part of
+// it after x from the last time round the ring.
+// Returns -1 if out of memory.
+static int
+pipeown(struct pipe *pi, uint x)
+{
+  int k = (x % PIPESIZE) / PGSIZE;
+  char *mem;
+
+  if(krefcnt(pi->page[k]) == 1)
+    return 0;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, pi->page[k], PGSIZE);
+  kfree(pi->page[k]);
+  pi->page[k] = mem;
+  return 0;
+}
+
+// Write n bytes from user address addr into the pipe. If
+// lend is set, page-aligned whole pages of the source are
+// lent to the ring instead of copied.
+static int
+pipeput(struct pipe *pi, uint64 addr, int n, int lend)
+{
+  int i = 0;
+  struct proc *pr = myproc();
+  uint nw, nr, m;
+  uint64 pa;
+  char *dst;
+
+  if(pipeenter(pi, &pi->writing) < 0)
+    return -1;
+  while(i < n){
+    if(__atomic_load_n(&pi->readopen, __ATOMIC_RELAXED) == 0){
+      i = -1;
+      break;
+    }
+    nw = pi->nwrite;
+    nr = __atomic_load_n(&pi->nread, __ATOMIC_ACQUIRE);
+    if(nw == nr + PIPESIZE){
+      pipekick(pi, &pi->rwait, &pi->nread);
+      if(pipewait(pi, 1) < 0){
+        i = -1;
+        break;
+      }
+      continue;
+    }
+    m = n - i;
+    if(m > nr + PIPESIZE - nw)
+      m = nr + PIPESIZE - nw;
+    if(lend && m >= PGSIZE && nw % PGSIZE == 0 && (addr + i) % PGSIZE == 0 &&
+       (pa = uvmlend(pr->pagetable, addr + i)) != 0){
+      kfree(pi->page[(nw % PIPESIZE) / PGSIZE]);
+      pi->page[(nw % PIPESIZE) / PGSIZE] = (char*)pa;
+      m = PGSIZE;
+    } else {
+      if(pipeown(pi, nw) < 0)
+        break;
+      dst = pipespan(pi, nw, &m);
+      if(copyin(pr->pagetable, dst, addr + i, m) == -1)
+        break;
+    }
+    __atomic_store_n(&pi->nwrite, nw + m, __ATOMIC_RELEASE);
+    i += m;
+  }
+  pipekick(pi, &pi->rwait, &pi->nread);
+  pipeleave(pi, &pi->writing);
 
   return i;
 }
 
+int
+pipewrite(struct pipe *pi, uint64 addr, int n)
+{
+  return pipeput(pi, addr, n, 0);
+}
+
+// Like pipewrite(), but lend whole pages rather than copy
+// them where addr and the ring are page-aligned. The lent
+// pages become copy-on-write for the writer.
+int
+pipesplice(struct pipe *pi, uint64 addr, int n)
+{
+  return pipeput(pi, addr, n, 1);
+}
+
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i = 0;
   struct proc *pr = myproc();
-  char ch;
+  uint nw, nr, m;
+  char *src;
 
-  acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
-      release(&pi->lock);
-      return -1;
-    }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  if(pipeenter(pi, &pi->reading) < 0)
+    return -1;
+  if(pipewait(pi, 0) < 0){
+    pipeleave(pi, &pi->reading);
+    return -1;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  while(i < n){  //DOC: piperead-copy
+    nr = pi->nread;
+    nw = __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE);
+    if(nr == nw)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    m = n - i;
+    if(m > nw - nr)
+      m = nw - nr;
+    src = pipespan(pi, nr, &m);
+    if(m == PGSIZE && (addr + i) % PGSIZE == 0){
+      // a whole page: map it rather than copy it.
+      kdup(src);
+      if(uvmremap(pr->pagetable, addr + i, (uint64)src) < 0){
+        kfree(src);
+        if(copyout(pr->pagetable, addr + i, src, m) == -1)
+          break;
+      }
+    } else if(copyout(pr->pagetable, addr + i, src, m) == -1)
       break;
+    __atomic_store_n(&pi->nread, nr + m, __ATOMIC_RELEASE);
+    i += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
-  release(&pi->lock);
+  pipekick(pi, &pi->wwait, &pi->nwrite);  //DOC: piperead-wakeup
+  pipeleave(pi, &pi->reading);
   return i;
 }
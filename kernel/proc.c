@@ -12,11 +12,34 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Each CPU has a queue of RUNNABLE processes, which it takes
+// from first and other CPUs steal from when theirs are empty.
+// A process is on exactly one queue while it is RUNNABLE and
+// has not yet been picked. A runq lock may be acquired while
+// holding a p->lock, not the other way round.
+//
+// Scheduling is a multi-level feedback queue: each queue has
+// a list per priority level, and the highest non-empty level
+// runs first. A process that uses up its level's quantum
+// (QUANTUM ticks) drops a level; one that sleeps first keeps
+// its level. Every BOOSTTICKS ticks all processes return to
+// the top level, or to their nice level if that is lower.
+#define QUANTUM(prio) (1 << (prio))
+#define EPOCH() (ticks / BOOSTTICKS)
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint epoch;           // last boost applied to this queue
+} runq[NCPU];
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void waitqinit(void);
 
 extern char trampoline[]; // trampoline.S
 
@@ -51,6 +74,9 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  waitqinit();
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -124,6 +150,12 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->epoch = EPOCH();
+  memset(p->ticks, 0, sizeof(p->ticks));
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -249,12 +281,14 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only raises p->sz; pages are allocated
+// when first touched (see uvmfault() in vm.c).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,9 +298,9 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > TRAPFRAME)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -307,6 +341,13 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = exedup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
+
+  np->nice = p->nice;
+  np->prio = p->nice;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -319,7 +360,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -362,8 +403,12 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    exeput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
 
   acquire(&wait_lock);
 
@@ -434,10 +479,107 @@ wait(uint64 addr)
   }
 }
 
+// Return p to its top priority level if there has been a
+// boost since it last looked.
+static void
+boost(struct proc *p)
+{
+  if(p->epoch != EPOCH()){
+    p->epoch = EPOCH();
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+}
+
+// Append p to its level's list in rq.
+// Caller must hold rq->lock.
+static void
+rqpush(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+}
+
+// Make p RUNNABLE and put it at the tail of the run queue
+// of the CPU it last ran on.
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  boost(p);
+  acquire(&rq->lock);
+  rqpush(rq, p);
+  release(&rq->lock);
+}
+
+// Is anything waiting in rq at a higher level than prio?
+static int
+rqwaiting(struct runq *rq, int prio)
+{
+  for(int i = 0; i < prio; i++){
+    if(__atomic_load_n(&rq->head[i], __ATOMIC_RELAXED))  // peek without the lock
+      return 1;
+  }
+  return 0;
+}
+
+// Take the process at the head of rq's highest non-empty
+// level, if any.
+static struct proc*
+rqpop(struct runq *rq)
+{
+  struct proc *p;
+  int i;
+
+  if(!rqwaiting(rq, NPRIO))
+    return 0;
+  acquire(&rq->lock);
+  p = 0;
+  for(i = 0; i < NPRIO && p == 0; i++){
+    if((p = rq->head[i]) != 0){
+      rq->head[i] = p->rqnext;
+      if(rq->head[i] == 0)
+        rq->tail[i] = 0;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Apply a priority boost to the processes waiting in rq.
+static void
+rqboost(struct runq *rq)
+{
+  struct proc *p, *next;
+
+  acquire(&rq->lock);
+  for(int i = 1; i < NPRIO; i++){
+    p = rq->head[i];
+    rq->head[i] = rq->tail[i] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      boost(p);
+      rqpush(rq, p);
+    }
+  }
+  rq->epoch = EPOCH();
+  release(&rq->lock);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the highest-priority process from this CPU's run
+//    queue, or if it is empty, from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -446,6 +588,7 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
   for(;;){
@@ -454,22 +597,33 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if(runq[id].epoch != EPOCH())
+      rqboost(&runq[id]);
+
+    p = rqpop(&runq[id]);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = rqpop(&runq[(id + i) % NCPU]);
+    if(p == 0)
+      continue;
+
+    // nothing else takes p off a queue, so it is still
+    // RUNNABLE; but the CPU it last ran on may still be
+    // switching away from it, holding p->lock.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -506,11 +660,58 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// Called on each timer interrupt while a process is running.
+// Charge the tick to the process's level, and give up the
+// CPU if it has used its quantum (dropping a level) or a
+// higher-priority process is waiting.
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  boost(p);
+  p->ticks[p->prio]++;
+  if(++p->slice >= QUANTUM(p->prio)){
+    p->slice = 0;
+    if(p->prio < NPRIO-1)
+      p->prio++;
+  } else if(!rqwaiting(&runq[p->cpu], p->prio)){
+    release(&p->lock);
+    return;
+  }
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
 
+// Add incr to the calling process's nice level, the highest
+// priority it may run at, keeping it within 0..NPRIO-1.
+// Returns the new level.
+int
+nice(int incr)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + incr;
+  if(n < 0)
+    n = 0;
+  if(n > NPRIO-1)
+    n = NPRIO-1;
+  p->nice = n;
+  if(p->prio < n)
+    p->prio = n;
+  release(&p->lock);
+  return n;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -535,53 +736,133 @@ forkret(void)
   usertrapret();
 }
 
+// Sleeping processes wait in a queue chosen by hashing their
+// chan, so that wakeup() looks only at processes that may be
+// sleeping on its chan. A waitq lock is acquired after the
+// lock passed to sleep() and before any p->lock.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+static struct waitq*
+chanq(void *chan)
+{
+  return &waitq[((uint64)chan >> 3) % NWAITQ];
+}
+
+static void
+waitqinit(void)
+{
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chanq(chan);
+  struct proc **pp;
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Must acquire wq->lock and p->lock in order to join the
+  // queue, change p->state and then call sched.
+  // Once we hold wq->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks wq->lock and then p->lock),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // wakeup() took p off the queue, but kill() does not.
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      break;
+    }
+  }
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void
-wakeup(void *chan)
+// Wake up processes sleeping on chan: all of them, or if
+// one is set, just the one that has waited longest.
+static void
+wake(void *chan, int one)
 {
-  struct proc *p;
+  struct waitq *wq = chanq(chan);
+  struct proc **pp, **last, *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&wq->lock);
+  do {
+    last = 0;
+    for(pp = &wq->head; (p = *pp) != 0; ){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING && p->chan == chan){
+        if(!one){
+          *pp = p->wqnext;
+          setrunnable(p);
+          release(&p->lock);
+          continue;
+        }
+        last = pp;  // newest first, so the last match is the oldest
       }
       release(&p->lock);
+      pp = &p->wqnext;
     }
-  }
+    if(last == 0)
+      break;
+    // kill() may have woken the waiter since the scan dropped
+    // its lock; if so, look for the next oldest.
+    p = *last;
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      *last = p->wqnext;
+      setrunnable(p);
+      last = 0;
+    }
+    release(&p->lock);
+  } while(last);
+  release(&wq->lock);
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+  wake(chan, 0);
+}
+
+// Wake up one process sleeping on chan, for callers where
+// only one waiter at a time can make progress.
+// Must be called without any p->lock.
+void
+wakeone(void *chan)
+{
+  wake(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -598,7 +879,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -683,6 +964,9 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" prio %d ticks", p->prio);
+    for(int i = 0; i < NPRIO; i++)
+      printf(" %d", p->ticks[i]);
     printf("\n");
   }
 }
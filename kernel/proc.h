@@ -81,6 +81,17 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A segment of a process's executable that exec() left to be
+// loaded page by page on first access; see execfault().
+#define NSEG 4
+struct seg {
+  uint64 va;                   // Start address, page-aligned
+  uint64 memsz;                // Size in memory
+  uint64 filesz;               // Bytes from the file; the rest is zero
+  uint64 off;                  // Offset in the executable
+  int perm;                    // PTE_X, PTE_W
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,10 +102,23 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p joins
+  int nice;                    // Highest priority level p may have
+  uint ticks[NPRIO];           // Ticks run at each priority level
+
+  // p->lock, or the run queue's lock while p is on a run queue,
+  // must be held when using these:
+  struct proc *rqnext;         // Next RUNNABLE proc in run queue
+  int prio;                    // Priority level, 0 is highest
+  int slice;                   // Ticks used of this level's quantum
+  uint epoch;                  // Last boost p has seen
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next proc sleeping in wait queue
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
@@ -103,5 +127,8 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct inode *exe;           // Executable, for seg
+  struct seg seg[NSEG];        // Demand-loaded segments of exe
+  int nseg;
   char name[16];               // Process name (debugging)
 };
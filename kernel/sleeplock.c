@@ -9,23 +9,88 @@
 #include "proc.h"
 #include "sleeplock.h"
 
+// How long acquiresleep() spins, in time CSR cycles (about
+// 20us in qemu), waiting for a holder that is running on
+// another CPU before it goes to sleep.
+#define SPINCYCLES 200
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->proc = 0;
+  lk->nwant = 0;
+  lk->nsleep = 0;
+  lk->nrsleep = 0;
   lk->pid = 0;
 }
 
+// Is the holder of lk running? A hint: read without locks.
+static int
+ownerrunning(struct sleeplock *lk)
+{
+  struct proc *p = __atomic_load_n(&lk->proc, __ATOMIC_RELAXED);
+
+  return p != 0 && __atomic_load_n(&p->state, __ATOMIC_RELAXED) == RUNNING;
+}
+
+// The exclusive holder of lk is running on another CPU, and
+// so is likely to release lk soon: spin until it does, it
+// stops running, or end passes, rather than sleep.
+// Caller must hold lk->lk, which is released while spinning.
+// Returns 0 without spinning if it isn't worth it.
+static int
+spin(struct sleeplock *lk, uint64 end)
+{
+  if(!lk->locked || !ownerrunning(lk) || r_time() >= end)
+    return 0;
+  release(&lk->lk);
+  while(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) &&
+        ownerrunning(lk) && r_time() < end)
+    ;
+  acquire(&lk->lk);
+  return 1;
+}
+
+// Wake whoever should get lk next, now that it is free:
+// a waiting exclusive holder if there is one, since shared
+// ones wait behind it, and otherwise every shared waiter.
+// Caller must hold lk->lk.
+static void
+wakewaiters(struct sleeplock *lk)
+{
+  if(lk->nwant){
+    if(lk->nsleep)
+      wakeone(lk);
+  } else if(lk->nrsleep){
+    wakeup(&lk->readers);
+  }
+}
+
+// Acquire lk exclusively, first spinning for a short while
+// if the holder is running, since it is then likely to
+// release lk soon and spinning costs less than two context
+// switches.
 void
 acquiresleep(struct sleeplock *lk)
 {
+  uint64 end = r_time() + SPINCYCLES;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->nwant++;
+  while (lk->locked || lk->readers) {
+    if(spin(lk, end))
+      continue;
+    lk->nsleep++;
     sleep(lk, &lk->lk);
+    lk->nsleep--;
   }
+  lk->nwant--;
   lk->locked = 1;
+  lk->proc = myproc();
   lk->pid = myproc()->pid;
   release(&lk->lk);
 }
@@ -35,8 +100,55 @@ releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->proc = 0;
+  lk->pid = 0;
+  wakewaiters(lk);
+  release(&lk->lk);
+}
+
+// Acquire lk shared with other readers. Waits while it is
+// held exclusively, or someone is waiting to hold it so, so
+// that a stream of readers cannot starve a writer. A process
+// must not acquire a lock shared twice.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  uint64 end = r_time() + SPINCYCLES;
+
+  acquire(&lk->lk);
+  while (lk->locked || lk->nwant) {
+    if(spin(lk, end))
+      continue;
+    lk->nrsleep++;
+    sleep(&lk->readers, &lk->lk);
+    lk->nrsleep--;
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0)
+    wakewaiters(lk);
+  release(&lk->lk);
+}
+
+// Turn the caller's exclusive hold on lk into a shared one.
+void
+downgradesleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->locked = 0;
+  lk->proc = 0;
   lk->pid = 0;
-  wakeup(lk);
+  lk->readers++;
+  if(lk->nwant == 0 && lk->nrsleep)
+    wakeup(&lk->readers);
   release(&lk->lk);
 }
 
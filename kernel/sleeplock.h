@@ -1,7 +1,14 @@
-// Long-term locks for processes
+// Long-term locks for processes.
+// Held either exclusively by one process, or shared by any
+// number of readers (see acquiresleepshared()).
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int readers;       // Number of shared holders
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *proc; // Process holding lock exclusively
+  int nwant;         // Exclusive waiters, asleep or spinning
+  int nsleep;        // Exclusive waiters asleep
+  int nrsleep;       // Shared waiters asleep
   
   // For debugging:
   char *name;        // Name of lock.
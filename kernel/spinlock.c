@@ -8,29 +8,96 @@
 #include "proc.h"
 #include "defs.h"
 
+// Every initialized lock is recorded in locks[] so that
+// statslock() can report on contention, as long as there is
+// room: tables that grow, like the inode table, can have
+// more locks than NLOCK.
+#define NLOCK 500
+
+static struct spinlock *locks[NLOCK];
+static struct spinlock lock_locks;
+
+// Record lk in locks[], if there is room.
+static void
+findslot(struct spinlock *lk)
+{
+  int i;
+
+  acquire(&lock_locks);
+  for(i = 0; i < NLOCK; i++){
+    if(locks[i] == lk)
+      break;
+    if(locks[i] == 0){
+      locks[i] = lk;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
+// Forget a lock that lives in memory about to be freed
+// (e.g. a pipe), so statslock() doesn't read a stale pointer.
+void
+freelock(struct spinlock *lk)
+{
+  int i;
+
+  acquire(&lock_locks);
+  for(i = 0; i < NLOCK; i++){
+    if(locks[i] == lk){
+      // keep locks[] dense: move the last entry into the hole.
+      int j;
+      for(j = i; j+1 < NLOCK && locks[j+1]; j++)
+        ;
+      locks[i] = locks[j];
+      locks[j] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->n = 0;
+  lk->nts = 0;
+  lk->nwait = 0;
+  lk->maxhold = 0;
+  if(lk != &lock_locks){
+    if(lock_locks.name == 0)
+      initlock(&lock_locks, "lock_locks");
+    findslot(lk);
+  }
 }
 
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
+//
+// This is a ticket lock: each acquire() takes the next ticket
+// and waits until release() advances lk->owner to it, so CPUs
+// get the lock in the order they asked for it.
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket;
+  int spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
   //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  //   s1 = &lk->next
+  //   amoadd.w a5, a5, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  while(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != ticket)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +107,26 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->n++;
+  if(spins){
+    lk->nts += spins;
+    lk->nwait++;
+  }
+  lk->start = r_time();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint64 held;
+
   if(!holding(lk))
     panic("release");
 
+  held = r_time() - lk->start;
+  if(held > lk->maxhold)
+    lk->maxhold = held;
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +137,12 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
+  // Release the lock by serving the next ticket, equivalent
+  // to lk->owner++. Only the holder writes lk->owner, but this
+  // code doesn't use a C assignment, since the C standard
   // implies that an assignment might be implemented with
   // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -77,7 +153,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->owner != lk->next && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +184,80 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+static int
+snprint_lock(char *buf, int sz, struct spinlock *lk)
+{
+  int n = 0;
+
+  if(lk->n > 0){
+    n = snprintf(buf, sz, "lock: %s: #test-and-set %d #acquire() %d #wait %d maxhold %d\n",
+                 lk->name, lk->nts, lk->n, lk->nwait, (int)lk->maxhold);
+  }
+  return n;
+}
+
+// Print the five locks with the largest key(lock) into buf.
+static int
+snprint_top(char *buf, int sz, uint64 (*key)(struct spinlock*))
+{
+  int i, j, n = 0;
+  struct spinlock *top[5];
+
+  memset(top, 0, sizeof(top));
+  for(i = 0; i < NLOCK && locks[i]; i++){
+    // insertion into top[], kept sorted by key, largest first.
+    for(j = 0; j < NELEM(top); j++){
+      if(top[j] == 0 || key(locks[i]) > key(top[j])){
+        memmove(&top[j+1], &top[j], (NELEM(top)-j-1)*sizeof(top[0]));
+        top[j] = locks[i];
+        break;
+      }
+    }
+  }
+  for(j = 0; j < NELEM(top) && top[j]; j++)
+    n += snprint_lock(buf+n, sz-n, top[j]);
+  return n;
+}
+
+static uint64
+spins(struct spinlock *lk)
+{
+  return lk->nts;
+}
+
+static uint64
+maxhold(struct spinlock *lk)
+{
+  return lk->maxhold;
+}
+
+// Print contention statistics into buf for the statistics device:
+// every kmem and bcache lock, then the five most contended locks
+// and the five held longest (maxhold is in time CSR cycles).
+int
+statslock(char *buf, int sz)
+{
+  int i, n;
+  int tot = 0;
+
+  acquire(&lock_locks);
+  n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
+  for(i = 0; i < NLOCK && locks[i]; i++){
+    if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
+       strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0){
+      tot += locks[i]->nts;
+      n += snprint_lock(buf+n, sz-n, locks[i]);
+    }
+  }
+
+  n += snprintf(buf+n, sz-n, "--- top 5 contended locks:\n");
+  n += snprint_top(buf+n, sz-n, spins);
+  n += snprintf(buf+n, sz-n, "--- top 5 longest-held locks:\n");
+  n += snprint_top(buf+n, sz-n, maxhold);
+
+  n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  release(&lock_locks);
+
+  return n;
+}
@@ -1,9 +1,16 @@
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket being served; held if != next.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For statistics (see statslock()):
+  int n;             // Number of acquire() calls.
+  int nts;           // Number of spins waiting for the lock.
+  int nwait;         // Number of acquire() calls that had to wait.
+  uint64 start;      // When the holder acquired it (time CSR).
+  uint64 maxhold;    // Longest time held, in time CSR cycles.
+};
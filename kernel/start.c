@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][8];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -66,16 +66,23 @@ timerinit()
   int id = r_mhartid();
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  int interval = TICKCYCLES; // about 1/10th second in qemu.
+  uint64 next = *(uint64*)CLINT_MTIME + interval;
+  *(uint64*)CLINT_MTIMECMP(id) = next;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
-  // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[4] : desired interval (in cycles) between ticks.
+  // scratch[5] : time of the next tick.
+  // scratch[6] : time of a sub-tick deadline, or -1 if none.
+  // scratch[7] : set by timervec when a tick has passed.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = next;
+  scratch[6] = -1;
+  scratch[7] = 0;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -86,4 +93,34 @@ timerinit()
 
   // enable machine-mode timer interrupts.
   w_mie(r_mie() | MIE_MTIE);
+
+  // allow supervisor mode to read the time CSR.
+  w_mcounteren(r_mcounteren() | 2);
+}
+
+// Ask for a timer interrupt on this CPU at time when, in
+// addition to the ticks, by lowering mtimecmp, which the
+// kernel page table maps. timervec goes back to the ticks
+// once when has passed.
+// Called in supervisor mode with interrupts off.
+void
+settimer(uint64 when)
+{
+  uint64 *scratch = timer_scratch[cpuid()];
+  volatile uint64 *cmp = (uint64*)scratch[3];
+
+  if(when < scratch[6])
+    scratch[6] = when;
+  __sync_synchronize();
+  if(when < *cmp)
+    *cmp = when;
+}
+
+// Did a tick pass since the last call? For the software
+// interrupts that timervec raises, which may instead be for
+// a settimer() deadline. Called with interrupts off.
+int
+timertick(void)
+{
+  return __atomic_exchange_n(&timer_scratch[cpuid()][7], 0, __ATOMIC_SEQ_CST);
 }
@@ -0,0 +1,85 @@
+//
+// The statistics device: a read-only text file that reports
+// kernel performance counters (lock contention and the like).
+// init mknod()s it as /statistics; user/statistics.c reads it.
+//
+// The report is generated when a reader starts at offset 0
+// and handed out in pieces until it is exhausted, at which
+// point read() returns 0 and the next read starts a fresh report.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;   // bytes of report in buf, or 0 if none generated yet
+  int off;  // bytes of report already read
+} stats;
+
+// Generate the report into buf.
+static int
+statsfill(char *buf, int sz)
+{
+  int n = 0;
+
+  n += statslock(buf+n, sz-n);
+  n += statslog(buf+n, sz-n);
+  n += statsbio(buf+n, sz-n);
+  n += statsdcache(buf+n, sz-n);
+  return n;
+}
+
+static int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+static int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquire(&stats.lock);
+
+  if(stats.sz == 0)
+    stats.sz = statsfill(stats.buf, BUFSZ);
+
+  m = stats.sz - stats.off;
+  if(m > n)
+    m = n;
+  if(m > 0){
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) == -1){
+      release(&stats.lock);
+      return -1;
+    }
+    stats.off += m;
+  } else {
+    // end of this report; the next read starts over.
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
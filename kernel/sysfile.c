@@ -76,6 +76,8 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    execprefault(myproc(), p, n);
   return fileread(f, p, n);
 }
 
@@ -90,6 +92,8 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    execprefault(myproc(), p, n);
 
   return filewrite(f, p, n);
 }
@@ -170,16 +174,18 @@ bad:
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// They needn't come first: an indexed directory's
+// entries are in hash order.
 static int
 isdirempty(struct inode *dp)
 {
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -222,6 +228,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheenter(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -341,6 +348,14 @@ sys_open(void)
     return -1;
   }
 
+  // a running program loads its pages from the file on demand,
+  // so it can't be changed.
+  if(ip->nexec > 0 && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -474,6 +489,28 @@ sys_exec(void)
   return -1;
 }
 
+// write to a pipe like write(), but lend whole page-aligned
+// pages of the buffer to the pipe instead of copying them.
+// the pages become copy-on-write for the caller.
+uint64
+sys_vmsplice(void)
+{
+  struct file *f;
+  int n;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_PIPE || f->writable == 0)
+    return -1;
+  if(n > 0)
+    execprefault(myproc(), p, n);
+
+  return pipesplice(f->pipe, p, n);
+}
+
 uint64
 sys_pipe(void)
 {
@@ -32,6 +32,8 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  if(p != 0)
+    execprefault(myproc(), p, sizeof(int));
   return wait(p);
 }
 
@@ -52,21 +54,32 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
+  return sleepticks(n);
+}
+
+// sleep for the given number of nanoseconds: whole ticks on
+// the timer wheel, then the rest until a timer interrupt at
+// the time itself.
+uint64
+sys_nsleep(void)
+{
+  uint64 ns, now, end, n;
+
+  argaddr(0, &ns);
+  now = r_time();
+  ns /= 1000000000 / CLINT_FREQ;
+  end = ns < ~0UL - now ? now + ns : ~0UL;
+  n = (end - now) / TICKCYCLES;
+  if(n > ~0U)
+    n = ~0U;
+  if(n > 0 && sleepticks(n) < 0)
+    return -1;
+  if(r_time() < end)
+    return sleepuntil(end);
   return 0;
 }
 
@@ -91,3 +104,14 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// change the calling process's nice level
+// by the given amount; return the new level.
+uint64
+sys_nice(void)
+{
+  int n;
+
+  argint(0, &n);
+  return nice(n);
+}
@@ -9,6 +9,24 @@
 struct spinlock tickslock;
 uint ticks;
 
+// A hierarchical timer wheel, so that each tick wakes only the
+// sleepers whose time may have come, rather than every sleeper.
+// A process sleeping until tick t, fewer than NWHEEL ticks
+// away, waits on wheel[0][t % NWHEEL]; one further away waits
+// on wheel[1][(t / NWHEEL) % NWHEEL], which is woken every
+// NWHEEL ticks, and moves down to wheel[0] once t is near.
+#define NWHEEL 64
+static char wheel[2][NWHEEL];
+
+// Processes sleeping until a time between ticks, sorted by
+// when, each with a timer interrupt asked for by settimer().
+// Protected by tickslock.
+struct timer {
+  uint64 when;
+  struct timer *next;
+};
+static struct timer *timers;
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -67,6 +85,10 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a demand-loaded, lazily-allocated,
+    // or copy-on-write page.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -78,7 +100,7 @@ usertrap(void)
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
-    yield();
+    schedtick();
 
   usertrapret();
 }
@@ -152,7 +174,7 @@ kerneltrap()
 
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    schedtick();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -165,7 +187,86 @@ clockintr()
 {
   acquire(&tickslock);
   ticks++;
-  wakeup(&ticks);
+  wakeup(&wheel[0][ticks % NWHEEL]);
+  if(ticks % NWHEEL == 0)
+    wakeup(&wheel[1][(ticks / NWHEEL) % NWHEEL]);
+  release(&tickslock);
+}
+
+// Sleep for n ticks.
+// Returns -1 if the process was killed, 0 otherwise.
+int
+sleepticks(uint n)
+{
+  uint ticks0, t;
+
+  acquire(&tickslock);
+  ticks0 = ticks;
+  t = ticks0 + n;
+  while(ticks - ticks0 < n){
+    if(killed(myproc())){
+      release(&tickslock);
+      return -1;
+    }
+    if(t - ticks < NWHEEL)
+      sleep(&wheel[0][t % NWHEEL], &tickslock);
+    else
+      sleep(&wheel[1][(t / NWHEEL) % NWHEEL], &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// Sleep until the time CSR reaches when, which should be
+// less than a tick or two away, using a timer interrupt
+// at that time rather than waiting for a tick.
+// Returns -1 if the process was killed, 0 otherwise.
+int
+sleepuntil(uint64 when)
+{
+  struct timer t, **pp;
+  int r = 0;
+
+  t.when = when;
+  acquire(&tickslock);
+  for(pp = &timers; *pp && (*pp)->when <= when; pp = &(*pp)->next)
+    ;
+  t.next = *pp;
+  *pp = &t;
+  settimer(when);
+  while(r_time() < when){
+    if(killed(myproc())){
+      r = -1;
+      break;
+    }
+    sleep(&t, &tickslock);
+  }
+  // timerintr() took t off the list, unless we were killed.
+  for(pp = &timers; *pp; pp = &(*pp)->next){
+    if(*pp == &t){
+      *pp = t.next;
+      break;
+    }
+  }
+  release(&tickslock);
+  return r;
+}
+
+// Wake the sleepuntil() sleepers whose time has come, and ask
+// for an interrupt for the next one.
+static void
+timerintr(void)
+{
+  struct timer *t;
+  uint64 now = r_time();
+
+  acquire(&tickslock);
+  while((t = timers) != 0 && t->when <= now){
+    timers = t->next;
+    wakeup(t);
+  }
+  if(timers)
+    settimer(timers->when);
   release(&tickslock);
 }
 
@@ -203,17 +304,21 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // forwarded by timervec in kernelvec.S: a tick, or a
+    // settimer() deadline, or both.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking for the cause,
+    // so that a new one isn't lost.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    int tick = timertick();
+    if(tick && cpuid() == 0){
+      clockintr();
+    }
+    timerintr();
+
+    return tick ? 2 : 1;
   } else {
     return 0;
   }
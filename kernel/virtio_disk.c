@@ -47,6 +47,9 @@ static struct disk {
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    struct buf **v;             // or, for virtio_disk_rwv(), n bufs
+    int n;
+    void (*done)(struct buf *); // completion callback, or 0
     char status;
   } info[NUM];
 
@@ -196,12 +199,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +214,31 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Hand the device a request to read or write the n buffers
+// bufs[0..n-1], as consecutive disk blocks starting at blockno.
+// The caller holds disk.vdisk_lock, fills in disk.info[] for the
+// returned head descriptor, and then notifies the device.
+static int
+queue(uint blockno, struct buf **bufs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = blockno * (BSIZE / 512);
+  int idx[LOGSIZE+2];  // the longest request is a whole log
 
-  acquire(&disk.vdisk_lock);
+  if(n < 1 || n > LOGSIZE)
+    panic("virtio_disk queue");
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
+  // a descriptor for type/reserved/sector, then the data, which
+  // may be split over several descriptors, then one for a 1-byte
+  // status result.
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +255,24 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    int d = idx[i+1];
+    disk.desc[d].addr = (uint64) bufs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[i+2];
+    bufs[i]->disk = 1;
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -278,19 +284,82 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
+  return idx[0];
+}
+
+// Start reading or writing b, and return without waiting
+// for the disk, unless all descriptors are in use.
+// When the disk finishes, virtio_disk_intr() clears b->disk,
+// wakes up any virtio_disk_wait(b), and calls done(b) if done
+// is not 0. done runs in interrupt context, so it must not sleep,
+// nor start more I/O, since queue() sleeps when it runs out of
+// descriptors. The caller must not touch b->data until then.
+void
+virtio_disk_start(struct buf *b, int write, void (*done)(struct buf *))
+{
+  acquire(&disk.vdisk_lock);
+
+  int id = queue(b->blockno, &b, 1, write);
+
+  // record struct buf for virtio_disk_intr().
+  disk.info[id].b = b;
+  disk.info[id].v = 0;
+  disk.info[id].done = done;
+
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// Wait for the operation started on b to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+// Read or write b, and wait for the disk to finish.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write, 0);
+  virtio_disk_wait(b);
+}
+
+// Start reading or writing the n buffers v[0..n-1] as the
+// consecutive disk blocks starting at blockno, whatever the
+// buffers' own blocknos, in a single request, and return
+// without waiting for the disk, unless all descriptors are
+// in use. All of v complete together, so virtio_disk_wait(v[0])
+// waits for the request. v must stay valid until then.
+void
+virtio_disk_startv(uint blockno, struct buf **v, int n, int write)
+{
+  acquire(&disk.vdisk_lock);
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  int id = queue(blockno, v, n, write);
+  disk.info[id].b = 0;
+  disk.info[id].v = v;
+  disk.info[id].n = n;
+  disk.info[id].done = 0;
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   release(&disk.vdisk_lock);
 }
 
+// Like virtio_disk_startv(), but wait for the disk.
+void
+virtio_disk_rwv(uint blockno, struct buf **v, int n, int write)
+{
+  virtio_disk_startv(blockno, v, n, write);
+  virtio_disk_wait(v[0]);
+}
+
 void
 virtio_disk_intr()
 {
@@ -317,10 +386,29 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
+    void (*done)(struct buf *) = disk.info[id].done;
+    if(disk.info[id].v){
+      for(int i = 0; i < disk.info[id].n; i++)
+        disk.info[id].v[i]->disk = 0;
+      wakeup(disk.info[id].v[0]);
+    }
+    disk.info[id].b = 0;
+    disk.info[id].v = 0;
+    disk.info[id].done = 0;
+    free_chain(id);
+    disk.used_idx += 1;
+
+    if(b == 0)
+      continue;
     b->disk = 0;   // disk is done with buf
     wakeup(b);
-
-    disk.used_idx += 1;
+    if(done){
+      // without the disk lock, so that the locks done takes
+      // to release b aren't nested inside it.
+      release(&disk.vdisk_lock);
+      done(b);
+      acquire(&disk.vdisk_lock);
+    }
   }
 
   release(&disk.vdisk_lock);
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,7 +17,14 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walklevel(pagetable_t, uint64, int, int*);
+static int uvmsplit(pagetable_t, uint64, pte_t*, int);
+static int uvmsupercopy(pte_t*, uint);
+static int uvmlazy(struct proc*, uint64);
+
 // Make a direct-map page table for the kernel.
+// mappages() uses 2MB superpages for the parts of
+// it that are aligned, which is most of RAM.
 pagetable_t
 kvmmake(void)
 {
@@ -30,6 +39,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for settimer() to program sub-tick timer interrupts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -82,15 +94,34 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va is in a superpage, returns the superpage's
+// level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but return the PTE at *level (0 or 1) rather
+// than always level 0. If a superpage leaf PTE is found
+// above that, return it instead, and set *level to its level.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X)){
+        // a leaf: va is in a superpage.
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,29 +130,37 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
+// Loads or allocates the page if it is part of the
+// current process's executable or heap but not yet present.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
+  struct proc *p = myproc();
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(p == 0 || p->pagetable != pagetable || uvmfault(p, va, 0) != 0)
+      return 0;
+    level = 0;
+    pte = walklevel(pagetable, va, 0, &level);
+  }
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va) - SUPERPGROUNDDOWN(va);
   return pa;
 }
 
@@ -138,13 +177,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Each 2MB-aligned run of 2MB that is also 2MB-aligned in
+// physical memory gets a single superpage PTE.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("mappages: va not aligned");
@@ -158,38 +200,76 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      level = 1;
+      sz = SUPERPGSIZE;
+    } else {
+      level = 0;
+      sz = PGSIZE;
+    }
+    if((pte = walklevel(pagetable, a, 1, &level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a + sz - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped (lazily-allocated
+// heap that was never touched) are skipped. A superpage
+// only partly in the range is first split into pages.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          superfree((void*)PTE2PA(*pte));
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // a superpage shared copy-on-write can't be split
+      // under the other page tables that map it.
+      if(krefcnt((void*)PTE2PA(*pte)) > 1 &&
+         uvmsupercopy(pte, PTE_FLAGS(*pte)) != 0)
+        panic("uvmunmap: copy");
+      if((*pte & (PTE_R|PTE_W|PTE_X)) == 0){
+        a -= PGSIZE;  // copied into pages; look again
+        continue;
+      }
+      // when freeing, the page at a can hold the new
+      // page-table page, so splitting can't fail.
+      if(uvmsplit(pagetable, a, pte, do_free) != 0)
+        panic("uvmunmap: split");
+      if(do_free)
+        continue;
+      pte = walk(pagetable, a, 0);
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -303,34 +383,39 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies the page table but not the physical
+// memory: writable pages become read-only and
+// copy-on-write in both, and uvmcow() copies
+// them when either process first writes.
+// Superpages are shared whole in the same way.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, i, size;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = 0; i < sz; i += size){
+    level = 0;
+    size = PGSIZE;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;  // lazily-allocated, never touched.
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(level == 1)
+      size = SUPERPGSIZE;
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, size, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
@@ -339,6 +424,233 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Replace the superpage PTE *pte, which maps va, with a
+// page-table page mapping the superpage's pages one by one,
+// each with its own reference count.
+// If reuse is set, the caller is unmapping and freeing the page
+// at va, and it becomes the page-table page instead of being mapped.
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmsplit(pagetable_t pagetable, uint64 va, pte_t *pte, int reuse)
+{
+  uint64 pa, base, a;
+  uint flags;
+  pagetable_t tbl;
+
+  pa = PTE2PA(*pte);
+  base = SUPERPGROUNDDOWN(va);
+  flags = PTE_FLAGS(*pte);
+  if(reuse)
+    tbl = (pagetable_t)(pa + PGROUNDDOWN(va) - base);
+  else if((tbl = (pagetable_t)kalloc()) == 0)
+    return -1;
+  supersplit((void*)pa);
+
+  memset(tbl, 0, PGSIZE);
+  for(a = base; a < base + SUPERPGSIZE; a += PGSIZE, pa += PGSIZE)
+    if((uint64)tbl != pa)
+      tbl[PX(0, a)] = PA2PTE(pa) | flags;
+  *pte = PA2PTE(tbl) | PTE_V;
+  return 0;
+}
+
+// Map zeroed memory at va if va is part of p's lazily-allocated
+// heap: below the process size, but never mapped.
+// Uses a superpage if none of the 2MB around va is mapped,
+// part of the executable, or beyond the process size.
+// Returns 0 on success, -1 if va is outside the heap
+// or memory is exhausted.
+static int
+uvmlazy(struct proc *p, uint64 va)
+{
+  uint64 base;
+  struct seg *s;
+  pte_t *pte;
+  char *mem;
+  int level;
+
+  if(va >= p->sz)
+    return -1;
+
+  base = SUPERPGROUNDDOWN(va);
+  level = 1;
+  pte = walklevel(p->pagetable, base, 0, &level);
+  if(base + SUPERPGSIZE <= p->sz && (pte == 0 || (*pte & PTE_V) == 0)){
+    for(s = p->seg; s < &p->seg[p->nseg]; s++)
+      if(s->va < base + SUPERPGSIZE && base < s->va + s->memsz)
+        break;
+    if(s == &p->seg[p->nseg] && (mem = superalloc()) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      if(mappages(p->pagetable, base, SUPERPGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+        superfree(mem);
+        return -1;
+      }
+      return 0;
+    }
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pagetable, PGROUNDDOWN(va), PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a page fault at user address va in process p:
+// load a page of the executable or fault in a lazily-allocated
+// heap page, or, for a store, break copy-on-write sharing.
+// Returns 0 if the faulting instruction can be retried,
+// -1 if the access is illegal or memory is exhausted.
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  int r;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(p->pagetable, PGROUNDDOWN(va), 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if((r = execfault(p, va)) <= 0)
+      return r;
+    return uvmlazy(p, va);
+  }
+  if(write && (*pte & PTE_COW))
+    return uvmcow(p->pagetable, va);
+  return -1;
+}
+
+// Give the page table its own writable copy of the
+// copy-on-write page containing va, copying the page
+// only if some other page table still shares it.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walklevel(pagetable, PGROUNDDOWN(va), 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers are gone; reuse the page.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if(level == 1)
+    return uvmsupercopy(pte, flags);
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Replace the shared superpage that *pte maps with a private
+// copy, mapped with permissions flags: in another superpage if
+// one is free, otherwise in 512 pages under a new page-table
+// page. Drops the reference to the shared superpage.
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmsupercopy(pte_t *pte, uint flags)
+{
+  uint64 pa = PTE2PA(*pte);
+  pagetable_t tbl;
+  char *mem;
+  int i;
+
+  if((mem = superalloc()) != 0){
+    memmove(mem, (char*)pa, SUPERPGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    superfree((void*)pa);
+    return 0;
+  }
+
+  if((tbl = (pagetable_t)kalloc()) == 0)
+    return -1;
+  memset(tbl, 0, PGSIZE);
+  for(i = 0; i < SUPERPGSIZE / PGSIZE; i++){
+    if((mem = kalloc()) == 0){
+      while(--i >= 0)
+        kfree((void*)PTE2PA(tbl[i]));
+      kfree(tbl);
+      return -1;
+    }
+    memmove(mem, (char*)pa + i*PGSIZE, PGSIZE);
+    tbl[i] = PA2PTE(mem) | flags;
+  }
+  *pte = PA2PTE(tbl) | PTE_V;
+  superfree((void*)pa);
+  return 0;
+}
+
+// Lend the user page at page-aligned va to the kernel, e.g.
+// for a pipe to pass on without copying: make it copy-on-write
+// if it is writable, so the user can no longer change it in
+// place, and return its physical address with a reference
+// for the caller. Returns 0 if va isn't a readable user page
+// mapped with a 4K leaf.
+uint64
+uvmlend(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level = 0;
+  uint64 pa;
+
+  if(walkaddr(pagetable, va) == 0)  // fault it in if need be
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || level != 0 || (*pte & (PTE_V|PTE_U|PTE_R)) != (PTE_V|PTE_U|PTE_R))
+    return 0;
+  if(*pte & PTE_W)
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+  pa = PTE2PA(*pte);
+  kdup((void*)pa);
+  return pa;
+}
+
+// Map page pa at page-aligned va in place of the page that
+// the user can write there, copy-on-write, so that the user
+// sees pa's contents as if they had been copied in. The
+// caller's reference to pa passes to the page table.
+// Returns -1, and the caller keeps its reference, if va
+// isn't a user-writable page mapped with a 4K leaf.
+int
+uvmremap(pagetable_t pagetable, uint64 va, uint64 pa)
+{
+  pte_t *pte;
+  int level = 0;
+  uint64 old;
+
+  if(walkaddr(pagetable, va) == 0)  // fault it in if need be
+    return -1;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || level != 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U) ||
+     (*pte & (PTE_W|PTE_COW)) == 0)
+    return -1;
+  old = PTE2PA(*pte);
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+  kfree((void*)old);
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -363,13 +675,17 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
+    if((pa0 = walkaddr(pagetable, va0)) == 0)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(*pte & PTE_COW){
+      if(uvmcow(pagetable, va0) != 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_W) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
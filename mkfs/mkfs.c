@@ -40,8 +40,12 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct dirent *de, int n);
 void die(const char *);
 
+struct dirent rootents[NINODES];
+int nrootents;
+
 // convert to riscv byte order
 ushort
 xshort(ushort x)
@@ -120,12 +124,12 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nrootents++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nrootents++] = de;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,7 +156,8 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nrootents < NINODES);
+    rootents[nrootents++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,10 +165,12 @@ main(int argc, char *argv[])
     close(fd);
   }
 
+  wdir(rootino, rootents, nrootents);
+
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1)/BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -249,6 +256,47 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding file block fbn of din,
+// allocating it and any indirect blocks on the way.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint addr, span, i;
+  int level;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+
+  span = NINDIRECT;
+  for(level = 1; fbn >= span; level++){
+    fbn -= span;
+    span *= NINDIRECT;
+  }
+  if(xint(din->addrs[NDIRECT+level-1]) == 0){
+    din->addrs[NDIRECT+level-1] = xint(freeblock++);
+  }
+  addr = xint(din->addrs[NDIRECT+level-1]);
+  for(; level > 0; level--){
+    span /= NINDIRECT;
+    i = fbn / span;
+    fbn %= span;
+    rsect(addr, (char*)indirect);
+    if(indirect[i] == 0){
+      indirect[i] = xint(freeblock++);
+      wsect(addr, (char*)indirect);
+    }
+    addr = xint(indirect[i]);
+  }
+  return addr;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +304,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -264,23 +311,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -293,6 +324,72 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Same as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;  // FNV-1a
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the n entries de[] into empty directory inum: as a plain
+// sequence if they fit in one block, otherwise as an indexed
+// directory (see kernel/fs.h), with as many buckets as it takes
+// to fit every entry in its bucket.
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  uchar blk[BSIZE];
+  struct dirhdr *h;
+  struct dirtab *t;
+  struct dirent *to;
+  int depth, nbucket, i, b, fits;
+  int count[1 << DIRMAXDEPTH];
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+    return;
+  }
+
+  for(depth = 1; depth <= DIRMAXDEPTH; depth++){
+    nbucket = 1 << depth;
+    bzero(count, sizeof(count));
+    fits = 1;
+    for(i = 0; i < n; i++)
+      if(++count[dirhash(de[i].name) & (nbucket - 1)] > DPB - 1)
+        fits = 0;
+    if(fits)
+      break;
+  }
+  if(depth > DIRMAXDEPTH)
+    die("wdir: too many entries");
+
+  // the index: bucket i is block i+1.
+  bzero(blk, BSIZE);
+  h = (struct dirhdr*)blk;
+  h->magic = xshort(DIRMAGIC);
+  h->depth = xshort(depth);
+  for(i = 0; i < nbucket; i++){
+    t = (struct dirtab*)blk + 1 + i/DIRTAB;
+    t->bucket[i%DIRTAB] = xshort(i + 1);
+  }
+  iappend(inum, blk, BSIZE);
+
+  for(b = 0; b < nbucket; b++){
+    bzero(blk, BSIZE);
+    h = (struct dirhdr*)blk;
+    h->depth = xshort(depth);
+    to = (struct dirent*)blk + 1;
+    for(i = 0; i < n; i++)
+      if((dirhash(de[i].name) & (nbucket - 1)) == b)
+        *to++ = de[i];
+    iappend(inum, blk, BSIZE);
+  }
+}
+
 void
 die(const char *s)
 {
@@ -0,0 +1,129 @@
+// Measure contention on the buffer cache's locks.
+// Several processes each read their own file in parallel;
+// with a hashed buffer cache the bcache locks should see
+// few failed test-and-sets.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NCHILD 4
+#define NBLOCK 10
+#define ROUNDS 500
+#define SZ 4096
+
+char buf[SZ];
+
+// Sum the "#test-and-set" counts of the bcache locks
+// in the statistics report.
+int
+ntas(int print)
+{
+  int n, total = 0;
+  char *c, *p;
+
+  if((n = statistics(buf, SZ-1)) < 0){
+    fprintf(2, "bcachetest: cannot read statistics\n");
+    exit(1);
+  }
+  buf[n] = 0;
+  if(print)
+    printf("%s", buf);
+  for(c = buf; (c = strchr(c, 'b')) != 0; c++){
+    if(memcmp(c, "bcache", 6) != 0)
+      continue;
+    if((p = strchr(c, '#')) == 0)
+      break;
+    p += strlen("#test-and-set ");
+    total += atoi(p);
+  }
+  return total;
+}
+
+void
+createfile(char *name)
+{
+  char data[BSIZE];
+  int fd, i;
+
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+    printf("bcachetest: create %s failed\n", name);
+    exit(1);
+  }
+  memset(data, name[0], sizeof(data));
+  for(i = 0; i < NBLOCK; i++){
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("bcachetest: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+readfile(char *name)
+{
+  char data[BSIZE];
+  int fd, i, j;
+
+  for(j = 0; j < ROUNDS; j++){
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("bcachetest: open %s failed\n", name);
+      exit(1);
+    }
+    for(i = 0; i < NBLOCK; i++){
+      if(read(fd, data, sizeof(data)) != sizeof(data) || data[0] != name[0]){
+        printf("bcachetest: read %s failed\n", name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+}
+
+void
+test0(void)
+{
+  char name[3] = "b0";
+  int i, m, n;
+
+  printf("start test0\n");
+  for(i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    createfile(name);
+  }
+
+  m = ntas(0);
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      name[1] = '0' + i;
+      readfile(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++)
+    wait(0);
+  printf("test0 results:\n");
+  n = ntas(1);
+  printf("bcache #test-and-set during test0: %d\n", n - m);
+
+  for(i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    unlink(name);
+  }
+  printf("test0 OK\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  test0();
+  exit(0);
+}
@@ -0,0 +1,182 @@
+//
+// tests for demand-paged exec and the executable page cache.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NCHILD 8
+
+// initialized data and a large bss, both loaded on demand.
+int data[3 * PGSIZE / sizeof(int)] = { 1, 2, 3 };
+char bss[64 * PGSIZE];
+
+// run as "exectest child": check that this image's data
+// and bss were loaded correctly, then scribble on them.
+void
+child(void)
+{
+  if(data[0] != 1 || data[1] != 2 || data[2] != 3){
+    printf("data segment not loaded\n");
+    exit(1);
+  }
+  for(int i = 0; i < sizeof(bss); i += PGSIZE){
+    if(bss[i] != 0){
+      printf("bss not zeroed\n");
+      exit(1);
+    }
+    bss[i] = 1;
+  }
+  data[0] = 99;
+  exit(0);
+}
+
+// many processes exec this program at once; they share its
+// text, and each must see unmodified data and bss.
+void
+concurrent(char *s)
+{
+  char *argv[] = { "exectest", "child", 0 };
+  int i, pid, xstatus;
+
+  for(i = 0; i < NCHILD; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      exec("exectest", argv);
+      printf("%s: exec failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  exit(0);
+}
+
+// read() into not-yet-loaded data pages, which the kernel
+// must load before copying into them.
+void
+readdata(char *s)
+{
+  int fd;
+
+  if((fd = open("exectest", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(read(fd, (char*)data + PGSIZE, PGSIZE) != PGSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  exit(0);
+}
+
+// a copy of this program, rewritten after it has been run
+// once, must run the new contents.
+void
+rewrite(char *s)
+{
+  char *argv[] = { "exectmp", "child", 0 };
+  char buf[512];
+  int fd, out, n, pid, xstatus;
+
+  if((fd = open("exectest", O_RDONLY)) < 0 ||
+     (out = open("exectmp", O_CREATE|O_WRONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(out, buf, n);
+  close(fd);
+  close(out);
+
+  for(int pass = 0; pass < 2; pass++){
+    if((pid = fork()) == 0){
+      exec("exectmp", argv);
+      exit(1);
+    }
+    wait(&xstatus);
+    if(pass == 0 && xstatus != 0){
+      printf("%s: copy failed to run\n", s);
+      exit(1);
+    }
+    if(pass == 1 && xstatus == 0){
+      printf("%s: ran stale contents\n", s);
+      exit(1);
+    }
+    // overwrite the file with garbage.
+    if((out = open("exectmp", O_WRONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    memset(buf, 0, sizeof(buf));
+    write(out, buf, sizeof(buf));
+    close(out);
+  }
+  unlink("exectmp");
+  exit(0);
+}
+
+// run each test in its own process. run returns 1 if the
+// child's exit status matched ok_status.
+int
+run(void f(char *), char *s, int ok_status)
+{
+  int pid;
+  int xstatus;
+
+  printf("running test %s\n", s);
+  if((pid = fork()) < 0) {
+    printf("runtest: fork error\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    f(s);
+    exit(0);
+  } else {
+    wait(&xstatus);
+    if(xstatus != ok_status)
+      printf("test %s: FAILED\n", s);
+    else
+      printf("test %s: OK\n", s);
+    return xstatus == ok_status;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct test {
+    void (*f)(char *);
+    char *s;
+    int ok_status;
+  } tests[] = {
+    { concurrent, "concurrent exec", 0 },
+    { readdata, "read into data", 0 },
+    { rewrite, "rewritten executable", 0 },
+    { 0, 0, 0 },
+  };
+  int fail = 0;
+
+  if(argc > 1 && strcmp(argv[1], "child") == 0)
+    child();
+
+  for (struct test *t = tests; t->s != 0; t++)
+    fail |= !run(t->f, t->s, t->ok_status);
+
+  if(fail){
+    printf("SOME TESTS FAILED\n");
+    exit(1);
+  }
+  printf("ALL TESTS PASSED\n");
+  exit(0);
+}
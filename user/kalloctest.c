@@ -0,0 +1,83 @@
+// Measure contention on the physical page allocator's locks.
+// Several processes allocate and free pages in parallel;
+// with per-CPU free lists the kmem locks should see almost
+// no failed test-and-sets.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NCHILD 2
+#define N 100000
+#define SZ 4096
+
+char buf[SZ];
+
+// Sum the "#test-and-set" counts of the kmem locks
+// in the statistics report.
+int
+ntas(int print)
+{
+  int n, total = 0;
+  char *c, *p;
+
+  if((n = statistics(buf, SZ-1)) < 0){
+    fprintf(2, "kalloctest: cannot read statistics\n");
+    exit(1);
+  }
+  buf[n] = 0;
+  if(print)
+    printf("%s", buf);
+  for(c = buf; (c = strchr(c, 'k')) != 0; c++){
+    if(memcmp(c, "kmem", 4) != 0)
+      continue;
+    if((p = strchr(c, '#')) == 0)
+      break;
+    p += strlen("#test-and-set ");
+    total += atoi(p);
+  }
+  return total;
+}
+
+void
+test1(void)
+{
+  void *a, *a1;
+  int n, m;
+
+  printf("start test1\n");
+  m = ntas(0);
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(i = 0; i < N; i++){
+        a = sbrk(4096);
+        *(int *)(a+4) = 1;
+        a1 = sbrk(-4096);
+        if(a1 != a + 4096){
+          printf("wrong sbrk\n");
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  for(int i = 0; i < NCHILD; i++)
+    wait(0);
+  printf("test1 results:\n");
+  n = ntas(1);
+  printf("kmem #test-and-set during test1: %d\n", n - m);
+  printf("test1 OK\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  test1();
+  exit(0);
+}
@@ -0,0 +1,245 @@
+//
+// tests for lazy (demand-zero) allocation of sbrk() memory.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define REGION_SZ (1024 * 1024 * 1024)
+
+// sbrk() a region larger than physical memory and touch
+// only a few pages of it; that must work, and the untouched
+// pages must read as zero.
+void
+sparse_memory(char *s)
+{
+  char *i, *prev_end, *new_end;
+  
+  prev_end = sbrk(REGION_SZ);
+  if (prev_end == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  new_end = prev_end + REGION_SZ;
+
+  for (i = prev_end + PGSIZE; i < new_end; i += 64 * PGSIZE)
+    *(char **)i = i;
+
+  for (i = prev_end + PGSIZE; i < new_end; i += 64 * PGSIZE) {
+    if (*(char **)i != i) {
+      printf("failed to read value from memory\n");
+      exit(1);
+    }
+    if (*(i + 2 * sizeof(char *)) != 0) {
+      printf("lazily-allocated page not zeroed\n");
+      exit(1);
+    }
+  }
+
+  exit(0);
+}
+
+// pass never-touched heap memory to system calls, which
+// must allocate it rather than fail.
+void
+sparse_memory_syscall(char *s)
+{
+  char *i, *prev_end, *new_end;
+  int fd;
+
+  prev_end = sbrk(REGION_SZ);
+  if (prev_end == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  new_end = prev_end + REGION_SZ;
+
+  for (i = prev_end + PGSIZE; i < new_end; i += 64 * PGSIZE) {
+    fd = open("lazytests.tmp", O_CREATE|O_RDWR);
+    if (fd < 0) {
+      printf("open failed\n");
+      exit(1);
+    }
+    // read() writes to the untouched page, write() reads from it.
+    if (write(fd, i, 16) != 16) {
+      printf("write() of untouched memory failed\n");
+      exit(1);
+    }
+    close(fd);
+    fd = open("lazytests.tmp", O_RDONLY);
+    if (read(fd, i + 32, 16) != 16) {
+      printf("read() into untouched memory failed\n");
+      exit(1);
+    }
+    close(fd);
+  }
+  unlink("lazytests.tmp");
+
+  exit(0);
+}
+
+// a large region, which the kernel maps with 2MB superpages,
+// must survive fork() and partial shrinking with sbrk().
+void
+large_region(char *s)
+{
+  char *a, *p;
+  int pid, xstatus;
+  int n = 8 * 1024 * 1024;
+
+  a = sbrk(n);
+  if (a == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (p = a; p < a + n; p += PGSIZE)
+    *(char **)p = p;
+
+  if ((pid = fork()) < 0) {
+    printf("fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (p = a; p < a + n; p += PGSIZE) {
+      if (*(char **)p != p) {
+        printf("child saw wrong value\n");
+        exit(1);
+      }
+      *(char **)p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0)
+    exit(1);
+  for (p = a; p < a + n; p += PGSIZE) {
+    if (*(char **)p != p) {
+      printf("child's writes seen by parent\n");
+      exit(1);
+    }
+  }
+
+  // a child that shrinks into the middle of the superpages
+  // it shares with its parent must not disturb the parent's.
+  if ((pid = fork()) < 0) {
+    printf("fork failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    sbrk(-(n / 2 + 3 * PGSIZE));
+    for (p = a; p < a + n / 2 - 3 * PGSIZE; p += PGSIZE) {
+      if (*(char **)p != p) {
+        printf("child's shrinking lost memory\n");
+        exit(1);
+      }
+      *(char **)p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0)
+    exit(1);
+  for (p = a; p < a + n; p += PGSIZE) {
+    if (*(char **)p != p) {
+      printf("child's shrinking seen by parent\n");
+      exit(1);
+    }
+  }
+
+  // shrink into the middle of the region, then grow back:
+  // the rest must be intact, and the regrown part zero.
+  sbrk(-(n / 2 + 3 * PGSIZE));
+  sbrk(n / 2 + 3 * PGSIZE);
+  for (p = a; p < a + n; p += PGSIZE) {
+    if (p < a + n / 2 - 3 * PGSIZE && *(char **)p != p) {
+      printf("shrinking lost memory\n");
+      exit(1);
+    }
+    if (p >= a + n / 2 - 3 * PGSIZE && *(char **)p != 0) {
+      printf("regrown memory not zeroed\n");
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// accesses beyond the break must still be fatal.
+void
+oob(char *s)
+{
+  volatile char *end = sbrk(0);
+  *(end + 4096) = 1;
+  printf("access beyond the break succeeded\n");
+  exit(0);
+}
+
+// touching more memory than the machine has must kill
+// the process, not the kernel.
+void
+oom(char *s)
+{
+  char *a, *p;
+
+  a = sbrk(REGION_SZ);
+  for (p = a; p < a + REGION_SZ; p += PGSIZE)
+    *p = 1;
+  printf("touched more memory than exists\n");
+  exit(0);
+}
+
+// run each test in its own process. run returns 1 if the
+// child's exit status matched ok_status.
+int
+run(void f(char *), char *s, int ok_status)
+{
+  int pid;
+  int xstatus;
+  
+  printf("running test %s\n", s);
+  if((pid = fork()) < 0) {
+    printf("runtest: fork error\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    f(s);
+    exit(0);
+  } else {
+    wait(&xstatus);
+    if(xstatus != ok_status) 
+      printf("test %s: FAILED\n", s);
+    else
+      printf("test %s: OK\n", s);
+    return xstatus == ok_status;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct test {
+    void (*f)(char *);
+    char *s;
+    int ok_status;
+  } tests[] = {
+    { sparse_memory, "lazy alloc", 0 },
+    { sparse_memory_syscall, "lazy alloc syscall", 0 },
+    { large_region, "large region", 0 },
+    { oob, "out of bounds", -1 },
+    { oom, "memory", -1 },
+    { 0, 0, 0 },
+  };
+  int fail = 0;
+
+  for (struct test *t = tests; t->s != 0; t++)
+    fail |= !run(t->f, t->s, t->ok_status);
+
+  if(fail){
+    printf("SOME TESTS FAILED\n");
+    exit(1);
+  }
+  printf("ALL TESTS PASSED\n");
+  exit(0);
+}
@@ -0,0 +1,99 @@
+// Log throughput benchmark, after stressfs: several processes
+// at once create files, write them, and delete them, so that
+// their FS system calls share log transactions.
+// Prints how long that took and the log's commit statistics.
+//
+//   logbench [nproc]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define NFILE 10
+#define NWRITE 8
+
+char data[BSIZE];
+char stats[4096];
+
+// Print the log line of the statistics report.
+void
+printlog(void)
+{
+  int n;
+  char *p, *e;
+
+  if((n = statistics(stats, sizeof(stats)-1)) < 0)
+    return;
+  stats[n] = 0;
+  for(p = stats; (p = strchr(p, 'l')) != 0; p++){
+    if(memcmp(p, "log:", 4) == 0){
+      if((e = strchr(p, '\n')) != 0)
+        *e = 0;
+      printf("%s\n", p);
+      return;
+    }
+  }
+}
+
+void
+worker(int id)
+{
+  char path[] = "logbench00";
+  int fd, i, j;
+
+  path[8] += id;
+  for(i = 0; i < NFILE; i++){
+    path[9] = '0' + i;
+    if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+      printf("logbench: cannot create %s\n", path);
+      exit(1);
+    }
+    for(j = 0; j < NWRITE; j++){
+      if(write(fd, data, sizeof(data)) != sizeof(data)){
+        printf("logbench: write failed\n");
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink(path);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, nproc = 4, xstatus, fail = 0;
+  uint start;
+
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(nproc < 1 || nproc > 10){
+    printf("usage: logbench [nproc]\n");
+    exit(1);
+  }
+  memset(data, 'a', sizeof(data));
+
+  printlog();
+  start = uptime();
+  for(i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("logbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      worker(i);
+  }
+  for(i = 0; i < nproc; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+  printf("logbench: %d processes, %d files each, %d ticks\n",
+         nproc, NFILE, uptime() - start);
+  printlog();
+  exit(fail);
+}
@@ -0,0 +1,127 @@
+//
+// tests for nice() and the multi-level feedback queue scheduler.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+// nice() adds to the nice level and clamps it to 0..NPRIO-1.
+void
+levels(char *s)
+{
+  if(nice(0) != 0 || nice(1) != 1 || nice(100) != NPRIO-1 ||
+     nice(-1) != NPRIO-2 || nice(-100) != 0){
+    printf("%s: wrong nice levels\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a child starts at its parent's nice level.
+void
+inherit(char *s)
+{
+  int pid, xstatus;
+
+  nice(1);
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(nice(0));
+  wait(&xstatus);
+  if(xstatus != 1){
+    printf("%s: child has nice level %d\n", s, xstatus);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a process that sleeps most of the time still gets the CPU
+// promptly while CPU hogs, even ones at the top level, run.
+void
+interactive(char *s)
+{
+  int pids[NCPU], i, t0, worst;
+
+  for(i = 0; i < NCPU; i++){
+    if((pids[i] = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0)
+      for(;;)
+        ;
+  }
+  worst = 0;
+  for(i = 0; i < 20; i++){
+    t0 = uptime();
+    sleep(1);
+    if(uptime() - t0 > worst)
+      worst = uptime() - t0;
+  }
+  for(i = 0; i < NCPU; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  if(worst > 2 * BOOSTTICKS){
+    printf("%s: waited %d ticks to run\n", s, worst);
+    exit(1);
+  }
+  exit(0);
+}
+
+// run each test in its own process. run returns 1 if the
+// child's exit status matched ok_status.
+int
+run(void f(char *), char *s, int ok_status)
+{
+  int pid;
+  int xstatus;
+
+  printf("running test %s\n", s);
+  if((pid = fork()) < 0) {
+    printf("runtest: fork error\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    f(s);
+    exit(0);
+  } else {
+    wait(&xstatus);
+    if(xstatus != ok_status)
+      printf("test %s: FAILED\n", s);
+    else
+      printf("test %s: OK\n", s);
+    return xstatus == ok_status;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct test {
+    void (*f)(char *);
+    char *s;
+    int ok_status;
+  } tests[] = {
+    { levels, "nice levels", 0 },
+    { inherit, "inherited nice", 0 },
+    { interactive, "interactive latency", 0 },
+    { 0, 0, 0 },
+  };
+  int fail = 0;
+
+  for (struct test *t = tests; t->s != 0; t++)
+    fail |= !run(t->f, t->s, t->ok_status);
+
+  if(fail){
+    printf("SOME TESTS FAILED\n");
+    exit(1);
+  }
+  printf("ALL TESTS PASSED\n");
+  exit(0);
+}
@@ -0,0 +1,215 @@
+//
+// tests for vmsplice() and zero-copy pipe reads.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGE 8
+
+char src[(NPAGE+1) * PGSIZE];
+char dst[(NPAGE+1) * PGSIZE];
+
+// page-aligned pointers into src and dst.
+char*
+aligned(char *buf)
+{
+  return (char*)PGROUNDUP((uint64)buf);
+}
+
+void
+fill(char *buf, int n, int seed)
+{
+  for(int i = 0; i < n; i++)
+    buf[i] = seed + i * 7;
+}
+
+int
+check(char *buf, int n, int seed)
+{
+  for(int i = 0; i < n; i++)
+    if(buf[i] != (char)(seed + i * 7))
+      return 0;
+  return 1;
+}
+
+// splice pages from a child, then change them in the child:
+// the reader must see the contents as they were when spliced,
+// including in the pages it had mapped rather than copied.
+void
+lend(char *s)
+{
+  int fds[2], pid, n, i, xstatus;
+  char *a = aligned(src), *b = aligned(dst);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fill(a, NPAGE * PGSIZE, 1);
+    if(vmsplice(fds[1], a, NPAGE * PGSIZE) != NPAGE * PGSIZE){
+      printf("%s: vmsplice failed\n", s);
+      exit(1);
+    }
+    fill(a, NPAGE * PGSIZE, 2);  // must not show up in the pipe
+    exit(0);
+  }
+  close(fds[1]);
+  for(i = 0; i < NPAGE * PGSIZE; i += n){
+    if((n = read(fds[0], b + i, NPAGE * PGSIZE - i)) <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(!check(b, NPAGE * PGSIZE, 1)){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  // the mapped pages must be writable, without changing the
+  // child's pages behind them.
+  fill(b, NPAGE * PGSIZE, 3);
+  if(!check(b, NPAGE * PGSIZE, 3)){
+    printf("%s: write to received page failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// fill the ring with lent pages, then copy more in behind a
+// reader that reads in small pieces, so that the writer comes
+// round to a lent page that the reader has only partly read.
+void
+wrap(char *s)
+{
+  int fds[2], pid, n, i, xstatus;
+  char *a = aligned(src), *b = aligned(dst);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fill(a, NPAGE * PGSIZE, 5);
+    if(vmsplice(fds[1], a, 4 * PGSIZE) != 4 * PGSIZE){
+      printf("%s: vmsplice failed\n", s);
+      exit(1);
+    }
+    if(write(fds[1], a + 4 * PGSIZE, 2 * PGSIZE) != 2 * PGSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  if(read(fds[0], b, 100) != 100){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  sleep(1);  // let the writer wrap round the ring
+  for(i = 100; (n = read(fds[0], b + i, 100)) > 0; i += n)
+    ;
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(i != 6 * PGSIZE || !check(b, 6 * PGSIZE, 5)){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// unaligned buffers fall back to copying.
+void
+unaligned(char *s)
+{
+  int fds[2], n, i;
+  char *a = aligned(src) + 100, *b = aligned(dst) + 10;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fill(a, 2 * PGSIZE, 4);
+  if(vmsplice(fds[1], a, 2 * PGSIZE) != 2 * PGSIZE){
+    printf("%s: vmsplice failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  for(i = 0; (n = read(fds[0], b + i, 3 * PGSIZE)) > 0; i += n)
+    ;
+  if(i != 2 * PGSIZE || !check(b, 2 * PGSIZE, 4)){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// run each test in its own process. run returns 1 if the
+// child's exit status matched ok_status.
+int
+run(void f(char *), char *s, int ok_status)
+{
+  int pid;
+  int xstatus;
+
+  printf("running test %s\n", s);
+  if((pid = fork()) < 0) {
+    printf("runtest: fork error\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    f(s);
+    exit(0);
+  } else {
+    wait(&xstatus);
+    if(xstatus != ok_status)
+      printf("test %s: FAILED\n", s);
+    else
+      printf("test %s: OK\n", s);
+    return xstatus == ok_status;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct test {
+    void (*f)(char *);
+    char *s;
+    int ok_status;
+  } tests[] = {
+    { lend, "lent pages", 0 },
+    { wrap, "wrap", 0 },
+    { unaligned, "unaligned", 0 },
+    { 0, 0, 0 },
+  };
+  int fail = 0;
+
+  for (struct test *t = tests; t->s != 0; t++)
+    fail |= !run(t->f, t->s, t->ok_status);
+
+  if(fail){
+    printf("SOME TESTS FAILED\n");
+    exit(1);
+  }
+  printf("ALL TESTS PASSED\n");
+  exit(0);
+}
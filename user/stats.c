@@ -0,0 +1,19 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define SZ 4096
+char buf[SZ];
+
+int
+main(void)
+{
+  int n;
+
+  if((n = statistics(buf, SZ)) < 0){
+    fprintf(2, "stats: cannot read statistics\n");
+    exit(1);
+  }
+  write(1, buf, n);
+  exit(0);
+}
@@ -22,6 +22,9 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int nice(int);
+int nsleep(uint64);
+int vmsplice(int, const void*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -39,3 +42,6 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// statistics.c
+int statistics(void*, int);
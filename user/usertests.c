@@ -575,6 +575,9 @@ writetest(char *s)
   }
 }
 
+// big enough to need the double-indirect block.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writebig(char *s)
 {
@@ -586,7 +589,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +609,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -2571,6 +2574,80 @@ badarg(char *s)
   exit(0);
 }
 
+// a program that is running can't be written or truncated,
+// since its pages are read from the file as they're used.
+void
+textbusy(char *s)
+{
+  int fd;
+
+  if((fd = open("usertests", O_WRONLY)) >= 0 ||
+     (fd = open("usertests", O_RDONLY|O_TRUNC)) >= 0){
+    printf("%s: opened running usertests for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// do sleep() and nsleep() wait about as long as asked,
+// and does a zero-length nsleep() return at once?
+void
+sleeptest(char *s)
+{
+  int t0, t1;
+
+  t0 = uptime();
+  if(nsleep(0) < 0 || nsleep(1) < 0){
+    printf("%s: nsleep failed\n", s);
+    exit(1);
+  }
+  t1 = uptime();
+  if(t1 - t0 > 1){
+    printf("%s: nsleep(0) took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  // sub-tick sleeps must not be rounded up to whole ticks.
+  t0 = uptime();
+  for(int i = 0; i < 10; i++){
+    if(nsleep(5000000) < 0){
+      printf("%s: nsleep failed\n", s);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  if(t1 - t0 > 2){
+    printf("%s: 10 nsleep(5ms) took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  t0 = uptime();
+  if(sleep(3) < 0){
+    printf("%s: sleep failed\n", s);
+    exit(1);
+  }
+  t1 = uptime();
+  if(t1 - t0 < 3){
+    printf("%s: sleep(3) returned after %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  t0 = uptime();
+  if(nsleep(300000000) < 0){
+    printf("%s: nsleep failed\n", s);
+    exit(1);
+  }
+  t1 = uptime();
+  if(t1 - t0 < 2){
+    printf("%s: nsleep(300ms) returned after %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +2712,8 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {sleeptest, "sleeptest" },
+  {textbusy, "textbusy" },
 
   { 0, 0},
 };